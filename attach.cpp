@@ -60,7 +60,17 @@ static struct termios cur_term;
 /* 1 if the window size changed */
 static int win_changed;
 
-static uint8_t this_index;
+static uint32_t this_index;
+/* The protocol version the master agreed to. */
+static uint8_t proto;
+/* The shared output ring of the master, if we read from it, and where we
+** are in it. Until the master agrees to it, what it sends is not taken for
+** frames, and until it says where to start, the ring is not read. */
+static const struct shm_ring *shm;
+static size_t shm_map_size;
+static bool shm_pending;
+static uint64_t shm_tail;
+static bool shm_started;
 
 /* Restores the original terminal settings. */
 static void restore_term(void) {
@@ -83,33 +93,405 @@ static conn_pipes connect_pipes(const char *name) {
 	};
 }
 
-static conn_pipes request_and_connect(const char *name) {
-	puts("note: if you see this message forever, check for stale pipe files");
+/*
+** Send an extended control request. The pipe can only be opened if a master
+** that reads it is there: older masters don't have one, and the one a dead
+** master left behind has no reader. Returns -1 with errno set otherwise.
+*/
+static int send_request(const char *name, const struct ctrl_req *req) {
+	int fd = open(str_fmt("%s_ctl", name), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return -1;
+
+	/* Less than PIPE_BUF, so it goes in whole or not at all. */
+	do
+		n = write(fd, req, sizeof(*req));
+	while (n < 0 && errno == EINTR);
+
+	close(fd);
+	return n == sizeof(*req) ? 0 : -1;
+}
+
+/*
+** Create and open the pipe a reply comes back on, in the runtime directory of
+** the master if it has one, or else next to the socket. Its name is stored in
+** reply, for the requester to remove afterwards.
+*/
+static int open_reply(const char *name, char *reply, size_t size) {
+	snprintf(reply, size, "%s_run/r%d", name, (int)getpid());
+	if (mkfifo(reply, 0600) && errno != EEXIST) {
+		snprintf(reply, size, "%s_r%d", name, (int)getpid());
+		ensure_mkfifo(reply);
+	}
+
+	return ensure_open(reply, O_RDONLY | O_NONBLOCK);
+}
+
+/* Turn the reply of the original handshake into a wide one. */
+static uint32_t widen_index(uint8_t byte) {
+	uint32_t index = byte & 0x7f;
+
+	if (index >= MAX_CLIENTS)
+		index = MAX_CLIENTS_WIDE;
+
+	return index | (byte & (1 << 7) ? 1U << 31 : 0);
+}
+
+/*
+** Ask for a slot with an extended request, so that clients connecting at the
+** same time never read each other's index. Returns -1 with errno set if the
+** request could not be sent, or to ETIMEDOUT if no index came back.
+*/
+static int request_index(const char *name, uint32_t *index) {
+	char reply[PATH_MAX];
+	uint8_t buf[sizeof(*index)];
+	struct ctrl_req req;
+	struct pollfd pfd;
+	int fd, ret = -1, err;
+
+	fd = open_reply(name, reply, sizeof(reply));
+
+	memset(&req, 0, sizeof(req));
+	req.op = CTRL_CREATE;
+	req.pid = getpid();
+	req.arg = PROTO_V2 | CREATE_WIDE;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (send_request(name, &req) == 0) {
+		/* A master busy with a storm of requests may take a while. */
+		err = ETIMEDOUT;
+		while (poll(&pfd, 1, 5 * REPLY_TIMEOUT) > 0) {
+			ssize_t len = read(fd, buf, sizeof(buf));
+
+			if (len == sizeof(buf)) {
+				memcpy(index, buf, sizeof(buf));
+				ret = 0;
+			} else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+				continue;
+			}
+			break;
+		}
+	} else {
+		err = errno;
+	}
+
+	close(fd);
+	unlink(reply);
+	errno = err;
+	return ret;
+}
+
+/*
+** Ask the master for a client slot and connect to its pipes. The index and the
+** protocol version the master agreed to are stored in index and version. If
+** anything goes wrong, both descriptors are -1 and errno says what, EBUSY if
+** the master is full.
+*/
+conn_pipes client_connect(const char *name, uint32_t *index, uint8_t *version) {
+	/* Masters without extended requests only understand the create byte,
+	** and answer it on the shared pipe. Those have no <socket>_ctl, or
+	** nobody reading it. A master that has one and only took too long is
+	** not asked there, it could hand us another client's index. */
+	if (request_index(name, index)) {
+		if (errno != ENOENT && errno != ENXIO)
+			return conn_pipes{-1, -1};
+
+		auto pmain = connect_pipes(name);
+
+		uint8_t ctrl_byte = (1 << 7) | PROTO_V2;
+
+		write_all(pmain.fd_miso, &ctrl_byte, 1);
+		read_all(pmain.fd_mosi, &ctrl_byte, 1);
+		*index = widen_index(ctrl_byte);
+
+		close(pmain.fd_miso);
+		close(pmain.fd_mosi);
+	}
 
-	auto pmain = connect_pipes(name);
+	/* Older masters reply with a plain index. */
+	if (*index & (1U << 31)) {
+		*version = PROTO_V2;
+		*index &= ~(1U << 31);
+	} else {
+		*version = PROTO_V1;
+	}
 
-	uint8_t ctrl_byte = 1 << 7;
+	if (*index >= MAX_CLIENTS_WIDE) {
+		errno = EBUSY;
+		return conn_pipes{-1, -1};
+	}
+
+	return connect_pipes(str_fmt("%s_%u", name, *index));
+}
 
-	write_all(pmain.fd_miso, &ctrl_byte, 1);
-	read_all(pmain.fd_mosi, &this_index, 1);
+static conn_pipes request_and_connect(const char *name) {
+	puts("note: if you see this message forever, check for stale pipe files");
 
-	close(pmain.fd_miso);
-	close(pmain.fd_mosi);
+	auto s = client_connect(name, &this_index, &proto);
 
-	if (this_index >= 127) {
-		puts("error: server is full");
+	if (s.fd_miso < 0) {
+		if (errno == EBUSY)
+			puts("error: server is full");
+		else
+			printf("error: %s\n", strerror(errno));
 		exit(2);
 	}
 
-	return connect_pipes(str_fmt("%s_%u", name, this_index));
+	return s;
 }
 
 static void disconnect(const char *name) {
-	auto pmain = connect_pipes(name);
+	/* Indices that fit are released the original way, any master
+	** understands that. Only masters that take extended requests hand
+	** out the others. */
+	if (this_index < MAX_CLIENTS) {
+		auto pmain = connect_pipes(name);
+		uint8_t ctrl_byte = this_index;
+
+		write_all(pmain.fd_miso, &ctrl_byte, 1);
+	} else {
+		struct ctrl_req req;
+
+		memset(&req, 0, sizeof(req));
+		req.op = CTRL_DISCONNECT;
+		req.pid = getpid();
+		req.arg = this_index;
+		send_request(name, &req);
+	}
+}
+
+/*
+** Write all of buf to the master. A frame is larger than PIPE_BUF, so a signal
+** can cut its write short, and the rest has to follow before anything else
+** does or the master takes payload for headers.
+*/
+static int write_msg(int s, const void *buf, size_t len) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = write(s, (const uint8_t *)buf + done, len - done);
+
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n > 0)
+			done += n;
+	}
+
+	return 0;
+}
+
+/*
+** Send a message to the master, as a single frame if it speaks them. Otherwise
+** fall back to packets, splitting up data that does not fit into one.
+*/
+static int send_msg(int s, int type, int arg, const void *data, size_t len) {
+	if (proto >= PROTO_V2) {
+		unsigned char buf[sizeof(struct frame) + FRAME_MAX];
+		struct frame hdr;
+
+		hdr.type = type;
+		hdr.arg = arg;
+		hdr.len = len;
+		memcpy(buf, &hdr, sizeof(hdr));
+		if (len)
+			memcpy(buf + sizeof(hdr), data, len);
 
-	uint8_t ctrl_byte = this_index;
+		return write_msg(s, buf, sizeof(hdr) + len);
+	}
+
+	struct packet pkt;
+
+	memset(&pkt, 0, sizeof(struct packet));
+	pkt.type = type;
 
-	write_all(pmain.fd_miso, &ctrl_byte, 1);
+	if (type != MSG_PUSH) {
+		pkt.len = arg;
+		if (len)
+			memcpy(pkt.u.buf, data, len);
+		return write_msg(s, &pkt, sizeof(struct packet));
+	}
+
+	for (size_t off = 0; off < len; off += pkt.len) {
+		pkt.len = len - off;
+		if (pkt.len > sizeof(pkt.u.buf))
+			pkt.len = sizeof(pkt.u.buf);
+
+		memcpy(pkt.u.buf, (const uint8_t *)data + off, pkt.len);
+		if (write_msg(s, &pkt, sizeof(struct packet)) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Map the shared output ring of the master, if it has one. It is only used
+** with frames, which carry its doorbells.
+*/
+static void map_ring(void) {
+	int fd;
+	struct stat st;
+	void *p;
+
+	if (proto < PROTO_V2)
+		return;
+
+	fd = open(str_fmt("%s_ring", sockname), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct shm_ring)) {
+		close(fd);
+		return;
+	}
+
+	p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+
+	shm = (const struct shm_ring *)p;
+	if (shm->magic != SHM_RING_MAGIC || !shm->size ||
+	    (shm->size & (shm->size - 1)) ||
+	    sizeof(struct shm_ring) + shm->size > (size_t)st.st_size) {
+		munmap(p, st.st_size);
+		shm = nullptr;
+		return;
+	}
+	shm_map_size = st.st_size;
+	shm_pending = true;
+}
+
+/*
+** Take the answer of the master to asking for the ring. If it says no, or
+** says nothing because the ring we found is not its own, stop using the ring
+** and write what came instead as plain output. Returns how much of buf was
+** used up.
+*/
+static size_t ring_answer(const unsigned char *buf, size_t len) {
+	struct frame hdr;
+	size_t off = 0;
+
+	if (len < sizeof(hdr))
+		return 0;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	shm_pending = false;
+	if (hdr.type == MSG_ATTACH && hdr.arg == ATTACH_RING && !hdr.len)
+		return sizeof(hdr);
+
+	munmap((void *)shm, shm_map_size);
+	shm = nullptr;
+	if (hdr.type == MSG_ATTACH && !hdr.len)
+		off = sizeof(hdr);
+	write(1, buf + off, len - off);
+	return len;
+}
+
+/* Ask the master to redraw, and tell it our window size. */
+static void send_redraw(int s) {
+	struct winsize ws;
+
+	memset(&ws, 0, sizeof(ws));
+	ioctl(0, TIOCGWINSZ, &ws);
+	send_msg(s, MSG_REDRAW, redraw_method, &ws, sizeof(ws));
+}
+
+/*
+** Where to carry on after falling behind by more than the ring holds: at the
+** first line in its newer half, so that we don't begin in the middle of an
+** escape sequence. If there is none, at the present.
+*/
+static uint64_t ring_resume(void) {
+	auto data = (const unsigned char *)(shm + 1);
+	size_t size = shm->size;
+	uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+
+	for (uint64_t seq = head > size / 2 ? head - size / 2 : 0; seq < head; seq++) {
+		if (data[seq & (size - 1)] == '\n')
+			return seq + 1;
+	}
+
+	return head;
+}
+
+/*
+** Write what the master published since we last looked to the terminal,
+** straight from the ring. If we fell so far behind that some of it was
+** overwritten, cancel what the terminal was in the middle of, skip ahead and
+** ask for a redraw. Then tell the master how far we got, so that it rings
+** again once there is more.
+*/
+static void drain_ring(int s) {
+	auto data = (const unsigned char *)(shm + 1);
+	size_t size = shm->size;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+		size_t off, len;
+
+		if (head == shm_tail)
+			break;
+
+		off = shm_tail & (size - 1);
+		len = head - shm_tail < size - off ? head - shm_tail : size - off;
+		if (head - shm_tail <= size)
+			write(1, data + off, len);
+
+		/* Whatever the master was writing at the time might have
+		** overwritten what we wrote out. */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->claim, __ATOMIC_RELAXED) - shm_tail > size) {
+			write(1, "\30", 1);
+			shm_tail = ring_resume();
+			send_redraw(s);
+			continue;
+		}
+
+		shm_tail += len;
+	}
+
+	send_msg(s, MSG_RING, 0, &shm_tail, sizeof(shm_tail));
+}
+
+/*
+** Handle the frames a ring client gets from the master: output meant for it
+** alone, where to start in the ring, and doorbells. Returns how much of buf
+** was used up.
+*/
+static size_t process_frames(int s, const unsigned char *buf, size_t len) {
+	size_t off = 0;
+
+	if (shm_pending) {
+		off = ring_answer(buf, len);
+		if (shm_pending || !shm)
+			return off;
+	}
+
+	while (len - off >= sizeof(struct frame)) {
+		struct frame hdr;
+
+		memcpy(&hdr, buf + off, sizeof(hdr));
+		if (len - off < sizeof(hdr) + hdr.len)
+			break;
+		off += sizeof(hdr);
+
+		if (hdr.type == MSG_PUSH) {
+			write(1, buf + off, hdr.len);
+		} else if (hdr.type == MSG_RING && hdr.len == sizeof(shm_tail)) {
+			memcpy(&shm_tail, buf + off, sizeof(shm_tail));
+			shm_started = true;
+		}
+		off += hdr.len;
+	}
+
+	if (shm_started)
+		drain_ring(s);
+
+	return off;
 }
 
 /* Signal */
@@ -130,13 +512,14 @@ static RETSIGTYPE win_change(int sig) {
 }
 
 /* Handles input from the keyboard. */
-static void process_kbd(int s, struct packet *pkt) {
+static void process_kbd(int s, const unsigned char *buf, size_t len) {
 	/* Suspend? */
-	if (!no_suspend && (pkt->u.buf[0] == cur_term.c_cc[VSUSP]))
+	if (!no_suspend && (buf[0] == cur_term.c_cc[VSUSP]))
 	{
-		/* Tell the master that we are suspending. */
-		pkt->type = MSG_DETACH;
-		write(s, pkt, sizeof(struct packet));
+		/* Tell the master that we are suspending. It says where to
+		** carry on in the ring once we are back. */
+		send_msg(s, MSG_DETACH, 0, nullptr, 0);
+		shm_started = false;
 
 		/* And suspend... */
 		tcsetattr(0, TCSADRAIN, &orig_term);
@@ -145,34 +528,31 @@ static void process_kbd(int s, struct packet *pkt) {
 		tcsetattr(0, TCSADRAIN, &cur_term);
 
 		/* Tell the master that we are returning. */
-		pkt->type = MSG_ATTACH;
-		write(s, pkt, sizeof(struct packet));
+		send_msg(s, MSG_ATTACH, shm ? ATTACH_RING : ATTACH_PLAIN, nullptr, 0);
 
 		/* We would like a redraw, too. */
-		pkt->type = MSG_REDRAW;
-		pkt->len = redraw_method;
-		ioctl(0, TIOCGWINSZ, &pkt->u.ws);
-		write(s, pkt, sizeof(struct packet));
+		send_redraw(s);
 		return;
 	}
 	/* Detach char? */
-	else if (pkt->u.buf[0] == detach_char)
+	else if (buf[0] == detach_char)
 	{
 		printf(EOS "\r\n[detached]\r\n");
 		disconnect(sockname);
 		exit(0);
 	}
 	/* Just in case something pukes out. */
-	else if (pkt->u.buf[0] == '\f')
+	else if (buf[0] == '\f')
 		win_changed = 1;
 
 	/* Push it out */
-	write(s, pkt, sizeof(struct packet));
+	send_msg(s, MSG_PUSH, 0, buf, len);
 }
 
 int attach_main(int noerror) {
-	struct packet pkt;
 	unsigned char buf[BUFSIZE];
+	unsigned char rxbuf[RXBUF_SIZE];
+	size_t rxlen = 0;
 	fd_set readfds;
 	conn_pipes s;
 
@@ -219,16 +599,13 @@ int attach_main(int noerror) {
 	/* Clear the screen. This assumes VT100. */
 	write(1, "\33[H\33[J", 6);
 
-	/* Tell the master that we want to attach. */
-	memset(&pkt, 0, sizeof(struct packet));
-	pkt.type = MSG_ATTACH;
-	write(s.fd_miso, &pkt, sizeof(struct packet));
+	/* Tell the master that we want to attach, and whether we read the
+	** output from its ring. */
+	map_ring();
+	send_msg(s.fd_miso, MSG_ATTACH, shm ? ATTACH_RING : ATTACH_PLAIN, nullptr, 0);
 
 	/* We would like a redraw, too. */
-	pkt.type = MSG_REDRAW;
-	pkt.len = redraw_method;
-	ioctl(0, TIOCGWINSZ, &pkt.u.ws);
-	write(s.fd_miso, &pkt, sizeof(struct packet));
+	send_redraw(s.fd_miso);
 
 	/* Wait for things to happen */
 	while (1) {
@@ -245,7 +622,30 @@ int attach_main(int noerror) {
 		}
 
 		/* Pty activity */
-		if (n > 0 && FD_ISSET(s.fd_mosi, &readfds))
+		if (n > 0 && FD_ISSET(s.fd_mosi, &readfds) && shm)
+		{
+			ssize_t len = read(s.fd_mosi, rxbuf + rxlen, sizeof(rxbuf) - rxlen);
+			size_t used;
+
+			if (len == 0)
+			{
+				printf(EOS "\r\n[EOF - dtach terminating]"
+					"\r\n");
+				exit(0);
+			}
+			else if (len < 0)
+			{
+				printf(EOS "\r\n[read returned an error]\r\n");
+				exit(1);
+			}
+
+			rxlen += len;
+			used = process_frames(s.fd_miso, rxbuf, rxlen);
+			rxlen -= used;
+			memmove(rxbuf, rxbuf + used, rxlen);
+			n--;
+		}
+		else if (n > 0 && FD_ISSET(s.fd_mosi, &readfds))
 		{
 			ssize_t len = read(s.fd_mosi, buf, sizeof(buf));
 
@@ -269,26 +669,25 @@ int attach_main(int noerror) {
 		{
 			ssize_t len;
 
-			pkt.type = MSG_PUSH;
-			memset(pkt.u.buf, 0, sizeof(pkt.u.buf));
-			len = read(0, pkt.u.buf, sizeof(pkt.u.buf));
+			len = read(0, buf, sizeof(buf));
 
 			if (len <= 0)
 				exit(1);
 
-			pkt.len = len;
-			process_kbd(s.fd_miso, &pkt);
+			process_kbd(s.fd_miso, buf, len);
 			n--;
 		}
 
 		/* Window size changed? */
 		if (win_changed)
 		{
+			struct winsize ws;
+
 			win_changed = 0;
 
-			pkt.type = MSG_WINCH;
-			ioctl(0, TIOCGWINSZ, &pkt.u.ws);
-			write(s.fd_miso, &pkt, sizeof(pkt));
+			memset(&ws, 0, sizeof(ws));
+			ioctl(0, TIOCGWINSZ, &ws);
+			send_msg(s.fd_miso, MSG_WINCH, 0, &ws, sizeof(ws));
 		}
 	}
 	return 0;
@@ -297,7 +696,7 @@ int attach_main(int noerror) {
 int
 push_main()
 {
-	struct packet pkt;
+	unsigned char buf[BUFSIZE];
 	conn_pipes s;
 
 	/* Attempt to open the socket. */
@@ -307,13 +706,11 @@ push_main()
 	signal(SIGPIPE, SIG_IGN);
 
 	/* Push the contents of standard input to the socket. */
-	pkt.type = MSG_PUSH;
 	for (;;)
 	{
 		ssize_t len;
 
-		memset(pkt.u.buf, 0, sizeof(pkt.u.buf));
-		len = read(0, pkt.u.buf, sizeof(pkt.u.buf));
+		len = read(0, buf, sizeof(buf));
 
 		if (len == 0)
 			return 0;
@@ -324,8 +721,7 @@ push_main()
 			return 1;
 		}
 
-		pkt.len = len;
-		if (write(s.fd_miso, &pkt, sizeof(struct packet)) < 0)
+		if (send_msg(s.fd_miso, MSG_PUSH, 0, buf, len) < 0)
 		{
 			printf("%s: %s: %s\n", progname, sockname,
 			       strerror(errno));
@@ -333,3 +729,449 @@ push_main()
 		}
 	}
 }
+
+/* The output went nowhere, or we were told to stop. */
+static RETSIGTYPE tap_die(int sig) {
+	disconnect(sockname);
+	exit(sig == SIGPIPE ? 0 : 1);
+}
+
+/*
+** Wait for the master to answer the tap request with an empty MSG_TAP frame.
+** One that does not know the request ignores it, and would leave us waiting
+** for output that never comes. Returns -1 if no answer came in time.
+*/
+static int tap_answer(int fd) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	struct frame hdr;
+	size_t got = 0;
+
+	while (got < sizeof(hdr)) {
+		ssize_t n;
+
+		if (poll(&pfd, 1, 5 * REPLY_TIMEOUT) <= 0)
+			return -1;
+
+		n = read(fd, (uint8_t *)&hdr + got, sizeof(hdr) - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		got += n;
+	}
+
+	return hdr.type == MSG_TAP && !hdr.len ? 0 : -1;
+}
+
+/* Copy what is read from the pipe to standard output, until it ends. */
+static int tap_copy(int fd) {
+	unsigned char buf[BUFSIZE];
+
+	for (;;)
+	{
+		ssize_t len = read(fd, buf, sizeof(buf));
+
+		if (len == 0)
+			return 0;
+		else if (len < 0 && errno == EINTR)
+			continue;
+		else if (len < 0)
+			return -1;
+
+		for (ssize_t done = 0; done < len;)
+		{
+			ssize_t n = write(1, buf + done, len - done);
+
+			if (n < 0 && errno != EINTR)
+				return -1;
+			if (n > 0)
+				done += n;
+		}
+	}
+}
+
+/*
+** Copy the output of the program to standard output, without attaching. The
+** master sends it to us like to an attached client, but there is no replay,
+** no redraw and no window size, so neither the program nor the other clients
+** notice. Where possible, the output is spliced from the pipe without being
+** copied through here.
+*/
+int
+tap_main()
+{
+	conn_pipes s;
+	int fd, ret;
+
+	/* Fail right away if nobody is listening, rather than waiting. */
+	fd = open(str_fmt("%s_miso", sockname), O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, sockname,
+			strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	s = client_connect(sockname, &this_index, &proto);
+	if (s.fd_miso < 0)
+	{
+		if (errno == EBUSY)
+			fprintf(stderr, "%s: %s: The master is full.\n",
+				progname, sockname);
+		else
+			fprintf(stderr, "%s: %s: %s\n", progname, sockname,
+				strerror(errno));
+		return 1;
+	}
+
+	signal(SIGPIPE, tap_die);
+	signal(SIGHUP, tap_die);
+	signal(SIGINT, tap_die);
+	signal(SIGTERM, tap_die);
+
+	/* Masters from before frames don't know the request either. */
+	if (proto < PROTO_V2 ||
+	    send_msg(s.fd_miso, MSG_TAP, 0, nullptr, 0) < 0 ||
+	    tap_answer(s.fd_mosi) < 0)
+	{
+		fprintf(stderr, "%s: %s: The master does not support "
+			"tapping the output.\n", progname, sockname);
+		disconnect(sockname);
+		return 1;
+	}
+
+#ifdef HAVE_SPLICE
+	for (;;)
+	{
+		ssize_t n = splice(s.fd_mosi, nullptr, 1, nullptr, READ_MAX,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (n > 0 || (n < 0 && errno == EINTR))
+			continue;
+		if (n == 0)
+			return 0;
+
+		/* Standard output can't be spliced to, copy it instead. */
+		if (errno == EINVAL)
+			break;
+		fprintf(stderr, "%s: %s: %s\n", progname, sockname,
+			strerror(errno));
+		disconnect(sockname);
+		return 1;
+	}
+#endif
+
+	ret = tap_copy(s.fd_mosi);
+	if (ret < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, sockname,
+			strerror(errno));
+		disconnect(sockname);
+		return 1;
+	}
+	return 0;
+}
+
+/* Print the counters of the master and its clients, without attaching. */
+int
+stats_main()
+{
+	char reply[PATH_MAX];
+	unsigned char buf[BUFSIZE];
+	struct ctrl_req req;
+	struct pollfd pfd;
+	int fd, s, ret = 1;
+
+	/* Fail right away if nobody is listening. */
+	s = open(str_fmt("%s_miso", sockname), O_WRONLY | O_NONBLOCK);
+	if (s < 0)
+	{
+		printf("%s: %s: %s\n", progname, sockname, strerror(errno));
+		return 1;
+	}
+	close(s);
+
+	/* Create the pipe for the reply before asking for it. */
+	fd = open_reply(sockname, reply, sizeof(reply));
+
+	memset(&req, 0, sizeof(req));
+	req.op = CTRL_STATS;
+	req.pid = getpid();
+
+	/* Anything sent to a master without the pipe for it would be taken
+	** for slots to create and disconnect, so don't even try. */
+	if (send_request(sockname, &req) < 0)
+	{
+		if (errno == ENOENT || errno == ENXIO)
+			printf("%s: %s: The master is too old to report "
+			       "statistics.\n", progname, sockname);
+		else
+			printf("%s: %s: %s\n", progname, sockname,
+			       strerror(errno));
+		close(fd);
+		unlink(reply);
+		return 1;
+	}
+
+	/* Copy the reply to stdout until the master closes its end. */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 5 * REPLY_TIMEOUT) > 0)
+	{
+		ssize_t len = read(fd, buf, sizeof(buf));
+
+		if (len > 0)
+		{
+			write_all(1, buf, len);
+			ret = 0;
+			continue;
+		}
+		else if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		break;
+	}
+
+	if (ret)
+		printf("%s: %s: No reply from the master.\n", progname, sockname);
+
+	close(fd);
+	unlink(reply);
+	return ret;
+}
+
+/*
+** The length of the UTF-8 sequence at buf, 0 if it is cut off at the end of
+** buf, or -1 if it is not valid.
+*/
+static int utf8_seq(const unsigned char *buf, size_t len) {
+	unsigned char lo = 0x80, hi = 0xbf;
+	int n;
+
+	if (buf[0] < 0x80)
+		return 1;
+	else if (buf[0] >= 0xc2 && buf[0] <= 0xdf)
+		n = 2;
+	else if (buf[0] >= 0xe0 && buf[0] <= 0xef)
+		n = 3;
+	else if (buf[0] >= 0xf0 && buf[0] <= 0xf4)
+		n = 4;
+	else
+		return -1;
+
+	/* No overlong forms, surrogates or code points past U+10FFFF. */
+	if (buf[0] == 0xe0)
+		lo = 0xa0;
+	else if (buf[0] == 0xed)
+		hi = 0x9f;
+	else if (buf[0] == 0xf0)
+		lo = 0x90;
+	else if (buf[0] == 0xf4)
+		hi = 0x8f;
+
+	for (int i = 1; i < n; i++)
+	{
+		if ((size_t)i >= len)
+			return 0;
+		if (buf[i] < (i == 1 ? lo : 0x80) || buf[i] > (i == 1 ? hi : 0xbf))
+			return -1;
+	}
+	return n;
+}
+
+/*
+** Print buf as the contents of a JSON string. Invalid UTF-8 is replaced, and
+** a sequence cut off at the end is left for the next piece of the same stream:
+** returns its length.
+*/
+static size_t print_json(const unsigned char *buf, size_t len) {
+	size_t off = 0;
+
+	while (off < len)
+	{
+		unsigned char c = buf[off];
+		int n = utf8_seq(buf + off, len - off);
+
+		if (n == 0)
+			break;
+		else if (n < 0)
+			fputs("\\ufffd", stdout);
+		else if (n > 1)
+			fwrite(buf + off, 1, n, stdout);
+		else if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", stdout);
+		else if (c == '\r')
+			fputs("\\r", stdout);
+		else if (c == '\t')
+			fputs("\\t", stdout);
+		else if (c < 0x20 || c == 0x7f)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+		off += n > 0 ? n : 1;
+	}
+	return len - off;
+}
+
+/* Write a 32 bit little endian value, as ttyrec wants them. */
+static void put_le32(unsigned char *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+** Export a session recorded with -l. The ring is copied first, so the master
+** can keep recording meanwhile: what it overwrote during the copy is behind
+** the tail it left, which is where the export starts. Timestamps of asciicast
+** are relative to the oldest event that is left, the ones of ttyrec are the
+** wall clock time.
+*/
+int export_main(const char *name, const char *format)
+{
+	const struct rec_header *hdr;
+	unsigned char *ring, *buf;
+	/* Cut off UTF-8 of the output and input streams, for asciicast. */
+	unsigned char carry[2][4];
+	size_t carried[2] = {0, 0};
+	uint64_t head, tail, first = 0;
+	unsigned rows, cols;
+	struct stat st;
+	bool ttyrec, started = false;
+	int fd;
+	void *p;
+
+	if (strcmp(format, "asciicast") == 0)
+		ttyrec = false;
+	else if (strcmp(format, "ttyrec") == 0)
+		ttyrec = true;
+	else
+	{
+		printf("%s: Invalid export format '%s'\n", progname, format);
+		printf("Try '%s --help' for more information.\n", progname);
+		return 1;
+	}
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+		return 1;
+	}
+
+	p = MAP_FAILED;
+	if ((size_t)st.st_size >= sizeof(struct rec_header))
+		p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	hdr = (const struct rec_header *)p;
+	if (p == MAP_FAILED || hdr->magic != REC_MAGIC || !hdr->size ||
+	    (hdr->size & (hdr->size - 1)) ||
+	    sizeof(struct rec_header) + hdr->size > (size_t)st.st_size)
+	{
+		fprintf(stderr, "%s: %s: Not a recording.\n", progname, name);
+		return 1;
+	}
+
+	ring = (unsigned char *)malloc(hdr->size);
+	buf = (unsigned char *)malloc(hdr->size + sizeof(carry[0]));
+	if (!ring || !buf)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(ENOMEM));
+		return 1;
+	}
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	memcpy(ring, hdr + 1, hdr->size);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	rows = hdr->rows ? hdr->rows : 24;
+	cols = hdr->cols ? hdr->cols : 80;
+
+	while (tail < head)
+	{
+		struct rec_event ev;
+		size_t off = tail & (hdr->size - 1), n, space;
+
+		memcpy(&ev, ring + off, sizeof(ev));
+		space = REC_SPACE(ev.len);
+		if (ev.len > hdr->size || tail + space > head)
+			break;
+
+		off = (off + sizeof(ev)) & (hdr->size - 1);
+		n = ev.len < hdr->size - off ? ev.len : hdr->size - off;
+		memcpy(buf + sizeof(carry[0]), ring + off, n);
+		memcpy(buf + sizeof(carry[0]) + n, ring, ev.len - n);
+		tail += space;
+
+		if (ttyrec)
+		{
+			uint64_t t = hdr->start + ev.time;
+			unsigned char rh[12];
+
+			if (ev.type != REC_OUTPUT)
+				continue;
+			put_le32(rh, t / 1000000);
+			put_le32(rh + 4, t % 1000000);
+			put_le32(rh + 8, ev.len);
+			fwrite(rh, 1, sizeof(rh), stdout);
+			fwrite(buf + sizeof(carry[0]), 1, ev.len, stdout);
+			continue;
+		}
+
+		if (!started)
+		{
+			started = true;
+			first = ev.time;
+			printf("{\"version\": 2, \"width\": %u, \"height\": %u, "
+			       "\"timestamp\": %" PRIu64 "}\n", cols, rows,
+			       (hdr->start + ev.time) / 1000000);
+		}
+
+		if (ev.type == REC_RESIZE && ev.len == 4)
+		{
+			uint16_t ws[2];
+
+			memcpy(ws, buf + sizeof(carry[0]), sizeof(ws));
+			printf("[%.6f, \"r\", \"%ux%u\"]\n",
+			       (ev.time - first) / 1e6, ws[1], ws[0]);
+		}
+		else if (ev.type == REC_OUTPUT || ev.type == REC_INPUT)
+		{
+			int s = ev.type == REC_INPUT;
+			unsigned char *data = buf + sizeof(carry[0]) - carried[s];
+			size_t len = carried[s] + ev.len;
+
+			memcpy(data, carry[s], carried[s]);
+			if (len == carried[s] ||
+			    (len < sizeof(carry[s]) && utf8_seq(data, len) == 0))
+			{
+				/* Still cut off, wait for the rest. */
+				memcpy(carry[s], data, len);
+				carried[s] = len;
+				continue;
+			}
+
+			printf("[%.6f, \"%c\", \"", (ev.time - first) / 1e6,
+			       s ? 'i' : 'o');
+			carried[s] = print_json(data, len);
+			memcpy(carry[s], data + len - carried[s], carried[s]);
+			fputs("\"]\n", stdout);
+		}
+	}
+
+	/* An empty recording still has a header. */
+	if (!ttyrec && !started)
+		printf("{\"version\": 2, \"width\": %u, \"height\": %u, "
+		       "\"timestamp\": %" PRIu64 "}\n", cols, rows,
+		       hdr->start / 1000000);
+
+	if (fflush(stdout) != 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,591 @@
+/*
+    This file is part of dtachez.
+
+    Copyright (C) 2023 SudoMaker, Ltd.
+    Author: Reimu NotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "dtachez.hpp"
+
+#include <sys/wait.h>
+
+/*
+** dtachez-bench: starts a master around a synthetic output generator (this
+** program, run with -G), attaches headless clients to it through the same
+** handshake as dtachez -a, and measures how fast the output fans out, how much
+** of it each client lost, and how long a keystroke takes to come back.
+**
+** The generator puts its terminal in raw mode and reacts to single bytes:
+**   P  echo a 'p'
+**   T  write the payload, as numbered lines, followed by an "end" line
+**   Q  exit, which takes the master down with it
+*/
+
+/* attach.cpp refers to these, main.cpp defines them for dtachez. */
+char *progname, *sockname;
+int detach_char = -1, no_suspend, redraw_method = REDRAW_NONE;
+struct termios orig_term;
+int dont_have_tty;
+
+/* Every payload line is LINE_LEN bytes: a 10 digit sequence number, a filler
+** derived from it, and a newline. */
+#define LINE_LEN	64
+#define SEQ_LEN		10
+#define END_LINE	"end"
+
+#define DEFAULT_COUNTS	"1,8,32,126"
+#define DEFAULT_PAYLOAD	(16 * 1024 * 1024)
+#define DEFAULT_ROUNDS	200
+
+/* Give up on a phase when nothing arrives for this long, in ms. */
+#define IDLE_TIMEOUT	3000
+
+enum {
+	PHASE_ECHO	= 0,
+	PHASE_STREAM	= 1,
+};
+
+struct bclient {
+	conn_pipes s;
+	uint32_t index;
+	uint8_t proto;
+	int closed, done;
+	/* PHASE_ECHO */
+	unsigned long echoes;
+	/* PHASE_STREAM */
+	unsigned long lines, last_seq;
+	size_t bytes;
+	uint64_t done_us;
+	char line[LINE_LEN];
+	size_t linelen;
+};
+
+static struct bclient *bclients;
+static struct pollfd *pfds;
+static int nr_bclients, phase;
+
+static const char *self_path, *dtachez_path;
+static char **master_args;
+static int nr_master_args;
+static size_t payload = DEFAULT_PAYLOAD;
+static int rounds = DEFAULT_ROUNDS;
+
+static char filler(unsigned long seq, int i) {
+	return 'a' + (seq + i) % 26;
+}
+
+/* Write line number seq into buf. */
+static void make_line(char *buf, unsigned long seq) {
+	char num[SEQ_LEN + 1];
+
+	snprintf(num, sizeof(num), "%0*lu", SEQ_LEN, seq % 10000000000UL);
+	memcpy(buf, num, SEQ_LEN);
+	for (int i = SEQ_LEN; i < LINE_LEN - 1; i++)
+		buf[i] = filler(seq, i);
+	buf[LINE_LEN - 1] = '\n';
+}
+
+static int generator(size_t bytes) {
+	char buf[BUFSIZE];
+	unsigned long nlines = bytes / LINE_LEN;
+	struct termios t;
+	unsigned char c;
+
+	/* Keep the output processing, so lines end in \r\n like they do for
+	** most programs. */
+	if (tcgetattr(0, &t) == 0) {
+		cfmakeraw(&t);
+		t.c_oflag |= OPOST | ONLCR;
+		tcsetattr(0, TCSANOW, &t);
+	}
+
+	while (read(0, &c, 1) == 1) {
+		if (c == 'P') {
+			write_all(1, "p", 1);
+		} else if (c == 'T') {
+			unsigned long seq = 1;
+
+			while (seq <= nlines) {
+				size_t len = 0;
+
+				for (; seq <= nlines && len + LINE_LEN <= sizeof(buf); seq++) {
+					make_line(buf + len, seq);
+					len += LINE_LEN;
+				}
+				write_all(1, buf, len);
+			}
+			write_all(1, END_LINE "\n", sizeof(END_LINE));
+		} else if (c == 'Q') {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Send a message to the master on behalf of a client. */
+static void send_to_master(struct bclient *c, int type, const void *data, size_t len) {
+	if (c->proto >= PROTO_V2) {
+		unsigned char buf[sizeof(struct frame) + 8];
+		struct frame hdr;
+
+		hdr.type = type;
+		hdr.arg = 0;
+		hdr.len = len;
+		memcpy(buf, &hdr, sizeof(hdr));
+		memcpy(buf + sizeof(hdr), data, len);
+		write_all(c->s.fd_miso, buf, sizeof(hdr) + len);
+	} else {
+		struct packet pkt;
+
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.type = type;
+		pkt.len = len;
+		memcpy(pkt.u.buf, data, len);
+		write_all(c->s.fd_miso, &pkt, sizeof(pkt));
+	}
+}
+
+/* Count a complete line if it is the next intact payload line. */
+static void finish_line(struct bclient *c) {
+	char want[LINE_LEN];
+	unsigned long seq;
+
+	if (c->linelen == sizeof(END_LINE) - 1 &&
+	    memcmp(c->line, END_LINE, c->linelen) == 0) {
+		c->done = 1;
+		c->done_us = now_us();
+		return;
+	}
+
+	if (c->linelen != LINE_LEN - 1)
+		return;
+
+	seq = 0;
+	for (int i = 0; i < SEQ_LEN; i++) {
+		if (c->line[i] < '0' || c->line[i] > '9')
+			return;
+		seq = seq * 10 + (c->line[i] - '0');
+	}
+
+	/* Lines replayed after a resync are not new. */
+	if (seq <= c->last_seq)
+		return;
+
+	make_line(want, seq);
+	if (memcmp(c->line, want, LINE_LEN - 1) == 0) {
+		c->lines++;
+		c->last_seq = seq;
+	}
+}
+
+/* Take in what a client received. */
+static void client_data(struct bclient *c, const unsigned char *buf, size_t len) {
+	if (phase == PHASE_ECHO) {
+		for (size_t i = 0; i < len; i++)
+			if (buf[i] == 'p')
+				c->echoes++;
+		return;
+	}
+
+	c->bytes += len;
+	for (size_t i = 0; i < len && !c->done; i++) {
+		if (buf[i] == '\n') {
+			finish_line(c);
+			c->linelen = 0;
+		} else if (buf[i] == '\r') {
+			continue;
+		} else if (c->linelen < sizeof(c->line)) {
+			c->line[c->linelen++] = buf[i];
+		}
+	}
+}
+
+/* Read whatever the clients have for us, waiting up to timeout ms for the
+** first of it. Returns the number of clients that were read from. */
+static int pump(int timeout) {
+	static unsigned char buf[64 * 1024];
+	int ready, n = 0;
+
+	ready = poll(pfds, nr_bclients, timeout);
+	if (ready <= 0)
+		return 0;
+
+	for (int i = 0; i < nr_bclients; i++) {
+		struct bclient *c = &bclients[i];
+		ssize_t len;
+
+		if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		len = read(c->s.fd_mosi, buf, sizeof(buf));
+		if (len > 0) {
+			client_data(c, buf, len);
+			n++;
+		} else if (len == 0 || errno != EINTR) {
+			/* The master dropped us. */
+			c->closed = 1;
+			pfds[i].fd = -1;
+		}
+	}
+
+	return n;
+}
+
+/* Start a master on sock around the generator. */
+static int start_master(const char *sock) {
+	char **argv = (char **)malloc(sizeof(char *) * (nr_master_args + 8));
+	char bytes[32];
+	int status, argc = 0;
+	pid_t pid;
+
+	snprintf(bytes, sizeof(bytes), "%zu", payload);
+
+	argv[argc++] = (char *)dtachez_path;
+	argv[argc++] = (char *)"-n";
+	argv[argc++] = (char *)sock;
+	argv[argc++] = (char *)"-r";
+	argv[argc++] = (char *)"none";
+	for (int i = 0; i < nr_master_args; i++)
+		argv[argc++] = master_args[i];
+	argv[argc++] = (char *)self_path;
+	argv[argc++] = (char *)"-G";
+	argv[argc++] = bytes;
+	argv[argc] = nullptr;
+
+	pid = fork();
+	if (pid < 0)
+		THROW_ERROR("fork");
+	if (pid == 0) {
+		execv(dtachez_path, argv);
+		printf("%s: %s: %s\n", progname, dtachez_path, strerror(errno));
+		_exit(127);
+	}
+	free(argv);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		return -1;
+
+	return 0;
+}
+
+/* Attach count headless clients. */
+static int attach_clients(const char *sock, int count) {
+	bclients = (struct bclient *)calloc(count, sizeof(struct bclient));
+	pfds = (struct pollfd *)calloc(count, sizeof(struct pollfd));
+	if (!bclients || !pfds)
+		THROW_ERROR("out of memory");
+
+	for (nr_bclients = 0; nr_bclients < count; nr_bclients++) {
+		struct bclient *c = &bclients[nr_bclients];
+
+		c->s = client_connect(sock, &c->index, &c->proto);
+		if (c->s.fd_miso < 0) {
+			if (errno == EBUSY)
+				printf("%s: the master is full after %d clients\n",
+				       progname, nr_bclients);
+			else
+				printf("%s: no slot after %d clients: %s\n",
+				       progname, nr_bclients, strerror(errno));
+			return -1;
+		}
+
+		send_to_master(c, MSG_ATTACH, nullptr, 0);
+
+		pfds[nr_bclients].fd = c->s.fd_mosi;
+		pfds[nr_bclients].events = POLLIN;
+	}
+
+	return 0;
+}
+
+static void detach_clients(void) {
+	for (int i = 0; i < nr_bclients; i++) {
+		close(bclients[i].s.fd_miso);
+		close(bclients[i].s.fd_mosi);
+	}
+
+	free(bclients);
+	free(pfds);
+	bclients = nullptr;
+	pfds = nullptr;
+	nr_bclients = 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Measure the keystroke to echo round trip of the first client. Fills in
+** rtt, sorted, and returns the number of rounds that came back. */
+static int measure_echo(uint64_t *rtt) {
+	struct bclient *c = &bclients[0];
+	int n = 0;
+
+	phase = PHASE_ECHO;
+
+	/* One round to warm up, which also waits for the generator to be
+	** ready. */
+	for (int r = -1; r < rounds; r++) {
+		unsigned long want = c->echoes + 1;
+		uint64_t t0 = now_us();
+
+		send_to_master(c, MSG_PUSH, "P", 1);
+		while (c->echoes < want && !c->closed) {
+			if (!pump(IDLE_TIMEOUT) && now_us() - t0 >= IDLE_TIMEOUT * 1000ULL)
+				break;
+		}
+		if (c->echoes < want)
+			break;
+		if (r >= 0)
+			rtt[n++] = now_us() - t0;
+	}
+
+	/* Collect the echoes of the other clients. */
+	while (pump(10))
+		;
+
+	qsort(rtt, n, sizeof(uint64_t), cmp_u64);
+	return n;
+}
+
+static uint64_t percentile(const uint64_t *v, int n, int p) {
+	if (!n)
+		return 0;
+	return v[(n - 1) * p / 100];
+}
+
+/* Have the generator write the payload and wait for the clients to take it
+** in. Returns the time from the request to the last client finishing. */
+static uint64_t measure_stream(void) {
+	uint64_t t0, last = 0;
+	int pending;
+
+	phase = PHASE_STREAM;
+	t0 = now_us();
+	send_to_master(&bclients[0], MSG_PUSH, "T", 1);
+
+	for (;;) {
+		pending = 0;
+		for (int i = 0; i < nr_bclients; i++)
+			if (!bclients[i].done && !bclients[i].closed)
+				pending++;
+		if (!pending)
+			break;
+
+		if (pump(IDLE_TIMEOUT))
+			last = now_us();
+		else
+			break;
+	}
+
+	for (int i = 0; i < nr_bclients; i++)
+		if (bclients[i].done && bclients[i].done_us > last)
+			last = bclients[i].done_us;
+
+	return last > t0 ? last - t0 : 1;
+}
+
+static int run(const char *dir, int count) {
+	char *sock = strdup(str_fmt("%s/bench%d", dir, count));
+	unsigned long nlines = payload / LINE_LEN;
+	uint64_t *rtt, elapsed;
+	double total = 0, loss, loss_sum = 0, loss_max = 0;
+	int n, lossy = 0, incomplete = 0;
+
+	if (start_master(sock)) {
+		printf("%s: failed to start the master\n", progname);
+		free(sock);
+		return -1;
+	}
+
+	if (attach_clients(sock, count)) {
+		detach_clients();
+		free(sock);
+		return -1;
+	}
+
+	rtt = (uint64_t *)malloc(sizeof(uint64_t) * (rounds + 1));
+	n = measure_echo(rtt);
+	elapsed = measure_stream();
+
+	for (int i = 0; i < nr_bclients; i++) {
+		struct bclient *c = &bclients[i];
+
+		total += c->bytes;
+		loss = nlines ? 100.0 * (nlines - c->lines) / nlines : 0;
+		loss_sum += loss;
+		if (loss > loss_max)
+			loss_max = loss;
+		if (c->lines < nlines)
+			lossy++;
+		if (!c->done)
+			incomplete++;
+	}
+
+	printf("%7d %10.1f %10.1f %8.2f%% %8.2f%% %6d %6d %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+	       count,
+	       total / elapsed,
+	       (double)payload / elapsed,
+	       loss_sum / nr_bclients, loss_max, lossy, incomplete,
+	       percentile(rtt, n, 50), percentile(rtt, n, 90),
+	       percentile(rtt, n, 99), n ? rtt[n - 1] : 0);
+	if (n < rounds)
+		printf("%s: only %d of %d echoes came back\n", progname, n, rounds);
+	fflush(stdout);
+
+	/* Stop the generator, and wait for the master to go away. */
+	send_to_master(&bclients[0], MSG_PUSH, "Q", 1);
+	phase = PHASE_ECHO;
+	for (uint64_t t0 = now_us(); now_us() - t0 < IDLE_TIMEOUT * 1000ULL;) {
+		int open = 0;
+
+		pump(100);
+		for (int i = 0; i < nr_bclients; i++)
+			open += !bclients[i].closed;
+		if (!open)
+			break;
+	}
+
+	free(rtt);
+	detach_clients();
+	free(sock);
+	return 0;
+}
+
+static void
+usage()
+{
+	printf(
+		"dtachez-bench - version %s, compiled on %s at %s.\n"
+		"Usage: dtachez-bench <options> [-- <dtachez options>]\n"
+		"Options:\n"
+		"  -c <counts>\tRun with each of the comma separated client "
+		"counts,\n"
+		"\t\t  defaults to " DEFAULT_COUNTS ".\n"
+		"  -n <size>\tHave the generator write <size> bytes of output, "
+		"defaults\n"
+		"\t\t  to %uM.\n"
+		"  -r <rounds>\tMeasure <rounds> keystroke round trips, defaults "
+		"to %u.\n"
+		"  -x <path>\tRun the dtachez at <path>, defaults to the one "
+		"next to\n"
+		"\t\t  dtachez-bench.\n"
+		"\nThe dtachez options, such as -k, -f, -q and -Q, are passed to "
+		"the master.\n",
+		PACKAGE_VERSION, __DATE__, __TIME__,
+		DEFAULT_PAYLOAD / (1024 * 1024), DEFAULT_ROUNDS);
+	exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	static char self[PATH_MAX], dir[] = "/tmp/dtachez-bench.XXXXXX";
+	const char *counts = DEFAULT_COUNTS;
+	char *list, *tok, *save;
+	ssize_t len;
+
+	progname = argv[0];
+	++argv; --argc;
+
+	/* The generator, run by the master. */
+	if (argc == 2 && strcmp(argv[0], "-G") == 0)
+		return generator(strtoul(argv[1], nullptr, 10));
+
+	while (argc >= 1 && **argv == '-')
+	{
+		char opt = argv[0][1];
+
+		if (strcmp(argv[0], "--") == 0) {
+			++argv; --argc;
+			break;
+		}
+		if (opt == '?' || opt == 'h' || argv[0][2] || argc < 2)
+			usage();
+
+		++argv; --argc;
+		if (opt == 'c')
+			counts = argv[0];
+		else if (opt == 'n')
+			payload = parse_size(argv[0]);
+		else if (opt == 'r')
+			rounds = atoi(argv[0]);
+		else if (opt == 'x')
+			dtachez_path = argv[0];
+		else
+			usage();
+		++argv; --argc;
+	}
+	master_args = argv;
+	nr_master_args = argc;
+
+	if ((long)payload < LINE_LEN || rounds < 1) {
+		printf("%s: Invalid payload size or number of rounds.\n",
+		       progname);
+		return 1;
+	}
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len > 0)
+		self[len] = 0;
+	else
+		strncpy(self, progname, sizeof(self) - 1);
+	self_path = self;
+
+	if (!dtachez_path) {
+		char *slash = strrchr(self, '/');
+
+		dtachez_path = strdup(slash ? str_fmt("%.*s/dtachez",
+			(int)(slash - self), self) : "dtachez");
+	}
+
+	if (!mkdtemp(dir))
+		THROW_ERROR("mkdtemp");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Every client takes two descriptors. */
+	raise_fd_limit();
+
+	printf("master: %s -r none", dtachez_path);
+	for (int i = 0; i < nr_master_args; i++)
+		printf(" %s", master_args[i]);
+	printf("\npayload: %zu bytes, %d round trips\n\n", payload, rounds);
+	printf("%7s %10s %10s %9s %9s %6s %6s %8s %8s %8s %8s\n",
+	       "clients", "agg MB/s", "MB/s", "avg loss", "max loss",
+	       "lossy", "short", "rtt p50", "p90", "p99", "max");
+	fflush(stdout);
+
+	list = strdup(counts);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(nullptr, ",", &save)) {
+		int count = atoi(tok);
+
+		if (count < 1 || count >= MAX_CLIENTS_WIDE) {
+			printf("%s: Invalid client count %s.\n", progname, tok);
+			continue;
+		}
+		run(dir, count);
+	}
+	free(list);
+
+	rmdir(dir);
+	return 0;
+}
@@ -55,6 +55,11 @@
 /* Define to 1 if you have the <stdlib.h> header file. */
 #define HAVE_STDLIB_H 1
 
+/* Define to 1 if you have the `splice' and `tee' functions. */
+#ifdef __linux__
+#define HAVE_SPLICE 1
+#endif
+
 /* Define to 1 if you have the `strerror' function. */
 #define HAVE_STRERROR 1
 
@@ -67,6 +72,16 @@
 /* Define to 1 if you have the <stropts.h> header file. */
 /* #undef HAVE_STROPTS_H */
 
+/* Define to 1 if you have the `sync_file_range' function. */
+#ifdef __linux__
+#define HAVE_SYNC_FILE_RANGE 1
+#endif
+
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#ifdef __linux__
+#define HAVE_SYS_EPOLL_H 1
+#endif
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 #define HAVE_SYS_IOCTL_H 1
 
@@ -82,7 +82,11 @@
 
 #include <termios.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -95,7 +99,20 @@
 #endif
 
 extern char *progname, *sockname;
-extern int detach_char, no_suspend, redraw_method;
+extern int detach_char, no_suspend, redraw_method, event_engine;
+extern int overflow_policy, fanout_method;
+extern unsigned block_timeout;
+extern int detached_policy;
+extern unsigned batch_interval;
+extern int winsize_policy;
+extern unsigned resize_delay;
+extern size_t client_queue_max, scrollback_size, read_max, shm_ring_size;
+extern unsigned long coalesce_us;
+extern size_t coalesce_bytes;
+extern int fifo_pool;
+extern char *runtime_dir;
+extern char *record_name;
+extern size_t record_size;
 extern struct termios orig_term;
 extern int dont_have_tty;
 
@@ -105,6 +122,10 @@ enum {
 	MSG_DETACH	= 2,
 	MSG_WINCH	= 3,
 	MSG_REDRAW	= 4,
+	MSG_RING	= 5,
+	MSG_TAP		= 6,
+	/* Not a message, counts the ones we don't know. */
+	MSG_OTHER	= 7,
 };
 
 enum {
@@ -112,6 +133,7 @@ enum {
 	REDRAW_NONE	= 1,
 	REDRAW_CTRL_L	= 2,
 	REDRAW_WINCH	= 3,
+	REDRAW_SNAPSHOT	= 4,
 };
 
 /* The client to master protocol. */
@@ -124,6 +146,182 @@ struct packet {
 	} u;
 };
 
+/* How the pty output gets to the clients. */
+enum {
+	FANOUT_COPY	= 0,
+	FANOUT_SPLICE	= 1,
+};
+
+/* What to do with a client whose output queue is full. */
+enum {
+	OVERFLOW_DROP	= 0,
+	OVERFLOW_RESYNC	= 1,
+	OVERFLOW_SYNC	= 2,
+	OVERFLOW_BLOCK	= 3,
+};
+
+/* What the master does with the pty while no client is attached. */
+enum {
+	DETACHED_READ	= 0,
+	DETACHED_STOP	= 1,
+	DETACHED_BATCH	= 2,
+};
+
+/* Whose window size the pty gets when several clients are attached. */
+enum {
+	WINSIZE_RECENT		= 0,
+	WINSIZE_SMALLEST	= 1,
+	WINSIZE_LARGEST		= 2,
+};
+
+/*
+** Protocol versions. A client asks for a version in the low bits of the create
+** byte of the control handshake. Older clients leave them clear, and get the
+** original packet protocol. A master that speaks frames says so by setting
+** the top bit of the index it replies with.
+*/
+enum {
+	PROTO_V1	= 0,
+	PROTO_V2	= 2,
+};
+
+/*
+** The version 2 client to master protocol. Each message is a frame header
+** followed by len bytes of payload. MSG_REDRAW passes the method in arg.
+** The master answers MSG_TAP with an empty MSG_TAP frame, and the plain
+** output follows.
+*/
+struct frame {
+	unsigned char type;
+	unsigned char arg;
+	uint16_t len;
+};
+
+/*
+** The shared output ring, <socket>_ring, published by a master started with
+** -m. The pty output is at data[seq % size], right after the header. head is
+** the sequence number the output is published up to, and claim the one the
+** master is writing up to. A reader that copied data from seq on checks claim
+** afterwards: if it is more than size ahead of seq, the copy was overrun.
+**
+** A v2 client that maps the ring attaches with ATTACH_RING in arg. The
+** master answers first with an empty MSG_ATTACH frame, with ATTACH_RING in arg
+** if the client gets the ring and ATTACH_PLAIN if not. Only after the former
+** does its pipe from the master carry frames instead of a plain stream:
+** MSG_PUSH frames for what only it gets, such as snapshots and the scrollback,
+** and MSG_RING frames. One with a sequence number as payload says where in
+** the ring to carry on after the frames before it, an empty one is a doorbell.
+** The client answers with a MSG_RING with the sequence number it caught up
+** to, and gets no other doorbell until then.
+*/
+#define SHM_RING_MAGIC 0x474e5244
+
+struct shm_ring {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t head;
+	uint64_t claim;
+	uint64_t reserved[5];
+};
+
+/*
+** The session recording, written by a master started with -l. The header is
+** followed by a ring of size bytes, and every event in it is a struct
+** rec_event followed by len bytes of data, taking REC_SPACE(len). head and tail
+** count the bytes written since the start: the events from tail up to head
+** are complete, and once the ring is full the oldest are dropped to make room.
+** The master moves tail on before it overwrites anything, so a reader that
+** copied the ring uses whichever tail it sees afterwards.
+**
+** time is in microseconds since start, the wall clock time in microseconds
+** when the recording started. rows and cols are the window size as of tail,
+** REC_RESIZE events carry the new size as two uint16_t, rows first.
+*/
+#define REC_MAGIC 0x43455a44
+
+struct rec_header {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t start;
+	uint16_t rows, cols;
+	uint32_t reserved[5];
+};
+
+struct rec_event {
+	uint64_t time;
+	uint32_t len;
+	uint8_t type;
+	uint8_t reserved[3];
+};
+
+/* The space an event takes in the ring. It is padded to the size of its
+** header, so that the header never wraps around the end. */
+#define REC_SPACE(len) \
+	((sizeof(struct rec_event) + (len) + 15) & ~(size_t)15)
+
+enum {
+	REC_OUTPUT	= 0,
+	REC_INPUT	= 1,
+	REC_RESIZE	= 2,
+};
+
+enum {
+	ATTACH_PLAIN	= 0,
+	ATTACH_RING	= 1,
+};
+
+/* The most clients a master serves over the original handshake. The index is
+** 7 bits on the wire, and MAX_CLIENTS itself means that the master is full. */
+#define MAX_CLIENTS 127
+
+/* The most clients a master serves in all, to those that ask for a wide index.
+** MAX_CLIENTS_WIDE itself means that the master is full. */
+#define MAX_CLIENTS_WIDE 65536
+
+/*
+** Extended control requests. They go on a pipe of their own, <socket>_ctl, as
+** a struct ctrl_req written in one go. Masters from before them read the
+** control pipe a byte at a time and take any byte for a create or a
+** disconnect, so nothing else may be sent there. Opening <socket>_ctl without
+** blocking fails unless a master that reads it is around, which is how a
+** requester finds out. Replies go to a pipe named r<pid> that the requester
+** creates beforehand, in the runtime directory of the master if it links one
+** as <socket>_run, and as <socket>_r<pid> if not.
+**
+** CTRL_CREATE is the handshake of the original create byte, with arg carrying
+** the protocol version. The new index comes back on the requester's own reply
+** pipe rather than the shared one, so any number of clients may connect at the
+** same time without picking up each other's replies. With CREATE_WIDE set in
+** arg, the reply is a 32 bit index instead of a byte, with the top bit set if
+** the master speaks frames, the same as in the byte.
+**
+** CTRL_DISCONNECT releases the slot whose index is in arg, for indices that
+** don't fit in the original disconnect byte.
+*/
+
+enum {
+	CTRL_STATS	= 1,
+	CTRL_CREATE	= 2,
+	CTRL_DISCONNECT	= 3,
+};
+
+#define CREATE_WIDE (1 << 8)
+
+struct ctrl_req {
+	uint8_t op;
+	uint8_t reserved[3];
+	int32_t pid;
+	uint32_t arg;
+};
+
+/* How long the master waits for a requester to read a reply, in ms. */
+#define REPLY_TIMEOUT 1000
+
+/* The most the master reads from the control pipe at once. */
+#define CTRL_BATCH 4096
+
 struct conn_pipes {
 	int fd_miso, fd_mosi;
 };
@@ -137,18 +335,118 @@ struct conn_pipes {
 */
 #define BUFSIZE 4096
 
+/* The default limit of the pty output the master reads in one go. It starts
+** at BUFSIZE, and grows up to the limit while the program keeps it full. */
+#define READ_MAX (64 * 1024)
+
+/* The most output the master reads or holds back at once. The zero-copy
+** fan-out has to fit it in a pipe, and this is the largest one Linux hands
+** out to anyone by default. */
+#define READ_LIMIT (1024 * 1024)
+
+/* The largest payload of a frame. */
+#define FRAME_MAX BUFSIZE
+
+/* The buffer the master reads client messages into. */
+#define RXBUF_SIZE (2 * (sizeof(struct frame) + FRAME_MAX))
+
+/* The default amount of output coalesced before it is sent out anyway. */
+#define COALESCE_BYTES (64 * 1024)
+
+/* The default limit of the output queued for a single client. */
+#define CLIENT_QUEUE_MAX (128 * 1024)
+
+/* The input queued for the program, past which the clients sending it are
+** no longer read until it drains. */
+#define INPUT_QUEUE_MAX (64 * 1024)
+
+/* How long a client may hold up the pty with the block policy, in ms. */
+#define BLOCK_TIMEOUT 10000
+
+/* How often a detached session reads the pty with the batch policy, in ms,
+** and how many reads it does at most each time. */
+#define BATCH_INTERVAL 1000
+#define BATCH_READS 64
+
+/* How often the master checks that the processes of its clients are still
+** around, in ms, where it cannot be told when they exit. */
+#define LIVENESS_INTERVAL 5000
+
+/* How long the window size has to stay put before the pty is resized, in ms. */
+#define RESIZE_DELAY 50
+
+/* The default size of the session recording, and how often the master starts
+** writing it back to disk, in ms. */
+#define RECORD_SIZE (16 * 1024 * 1024)
+#define RECORD_SYNC_INTERVAL 1000
+
+/* A growable byte ring buffer. */
+struct ring {
+	unsigned char *buf;
+	size_t size, head, len;
+};
+
 /* This hopefully moves to the bottom of the screen */
 #define EOS "\033[999H"
 
+enum {
+	ENGINE_AUTO	= 0,
+	ENGINE_EPOLL	= 1,
+	ENGINE_SELECT	= 2,
+};
+
+/* The event engine. */
+enum {
+	EV_READ		= 1 << 0,
+	EV_WRITE	= 1 << 1,
+};
+
+#define EV_MAX_EVENTS	64
+
+struct ev_event {
+	void *data;
+	int events;
+};
+
+extern int ev_init(int want);
+extern int ev_add(int fd, int events, void *data);
+extern int ev_mod(int fd, int events, void *data);
+extern void ev_del(int fd);
+extern int ev_wait(struct ev_event *evs, int max, int timeout);
+
+/* The screen model, see screen.cpp. */
+extern bool screen_active;
+extern void screen_init(int rows, int cols);
+extern void screen_resize(int rows, int cols);
+extern void screen_feed(const unsigned char *buf, size_t len);
+extern char *screen_snapshot(size_t *len);
+struct screen_view;
+extern char *screen_sync(struct screen_view **view, size_t *len);
+extern void screen_view_free(struct screen_view *view);
+
+conn_pipes client_connect(const char *name, uint32_t *index, uint8_t *version);
 int attach_main(int noerror);
 int master_main(char **argv, int waitattach, int dontfork);
 int push_main(void);
+int tap_main(void);
+int export_main(const char *name, const char *format);
+int stats_main(void);
 
 extern int setnonblocking(int fd);
 extern void write_all(int fd, const void *buf, size_t count);
 extern void read_all(int fd, void *buf, size_t count);
 extern int ensure_open(const char *s, int m);
 extern void ensure_mkfifo(const char *s);
+extern void ensure_symlink(const char *target, const char *s);
+extern void drain_fd(int fd);
+extern void raise_fd_limit(void);
+extern long parse_size(const char *s);
+extern uint64_t now_us(void);
+extern int ring_push(struct ring *r, const void *data, size_t count, size_t limit);
+extern int ring_peek(const struct ring *r, struct iovec iov[2]);
+extern void ring_consume(struct ring *r, size_t count);
+extern void ring_clear(struct ring *r);
+extern void ring_free(struct ring *r);
 extern char *_str_fmt(const char *fmt, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
 
 #define str_fmt(...) strdupa(_str_fmt(__VA_ARGS__))
@@ -0,0 +1,202 @@
+/*
+    This file is part of dtachez.
+
+    Copyright (C) 2023 SudoMaker, Ltd.
+    Author: Reimu NotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "dtachez.hpp"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/*
+** The event engine. Descriptors are registered once with the events they are
+** interested in, and ev_wait() only hands back the ones that are ready. On
+** Linux this is backed by epoll, so the cost of a wakeup depends on the number
+** of ready descriptors only. Everywhere else (or if epoll is unavailable at
+** runtime) we fall back to select() over persistent fd_sets.
+*/
+
+static int engine = ENGINE_SELECT;
+
+/* select() state */
+static fd_set sel_readfds, sel_writefds;
+static int sel_highest_fd = -1;
+static void *sel_data[FD_SETSIZE];
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1;
+
+static uint32_t to_epoll(int events) {
+	uint32_t ret = 0;
+
+	if (events & EV_READ)
+		ret |= EPOLLIN;
+	if (events & EV_WRITE)
+		ret |= EPOLLOUT;
+
+	return ret;
+}
+
+static int epoll_ctl_fd(int op, int fd, int events, void *data) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll(events);
+	ev.data.ptr = data;
+
+	return epoll_ctl(epfd, op, fd, &ev);
+}
+#endif
+
+int ev_init(int want) {
+	FD_ZERO(&sel_readfds);
+	FD_ZERO(&sel_writefds);
+	sel_highest_fd = -1;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (want != ENGINE_SELECT) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd >= 0) {
+			engine = ENGINE_EPOLL;
+			return engine;
+		}
+	}
+#endif
+
+	engine = ENGINE_SELECT;
+	return engine;
+}
+
+int ev_add(int fd, int events, void *data) {
+#ifdef HAVE_SYS_EPOLL_H
+	if (engine == ENGINE_EPOLL)
+		return epoll_ctl_fd(EPOLL_CTL_ADD, fd, events, data);
+#endif
+
+	if (fd < 0 || fd >= FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sel_data[fd] = data;
+	if (fd > sel_highest_fd)
+		sel_highest_fd = fd;
+
+	return ev_mod(fd, events, data);
+}
+
+int ev_mod(int fd, int events, void *data) {
+#ifdef HAVE_SYS_EPOLL_H
+	if (engine == ENGINE_EPOLL)
+		return epoll_ctl_fd(EPOLL_CTL_MOD, fd, events, data);
+#endif
+
+	sel_data[fd] = data;
+
+	if (events & EV_READ)
+		FD_SET(fd, &sel_readfds);
+	else
+		FD_CLR(fd, &sel_readfds);
+
+	if (events & EV_WRITE)
+		FD_SET(fd, &sel_writefds);
+	else
+		FD_CLR(fd, &sel_writefds);
+
+	return 0;
+}
+
+void ev_del(int fd) {
+#ifdef HAVE_SYS_EPOLL_H
+	if (engine == ENGINE_EPOLL) {
+		epoll_ctl_fd(EPOLL_CTL_DEL, fd, 0, nullptr);
+		return;
+	}
+#endif
+
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return;
+
+	FD_CLR(fd, &sel_readfds);
+	FD_CLR(fd, &sel_writefds);
+	sel_data[fd] = nullptr;
+
+	while (sel_highest_fd >= 0 && !sel_data[sel_highest_fd])
+		sel_highest_fd--;
+}
+
+/* Wait for events. timeout is in milliseconds, -1 blocks forever. Returns the
+** number of entries filled in evs, or -1 on error. */
+int ev_wait(struct ev_event *evs, int max, int timeout) {
+	int n = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (engine == ENGINE_EPOLL) {
+		struct epoll_event epevs[EV_MAX_EVENTS];
+
+		if (max > EV_MAX_EVENTS)
+			max = EV_MAX_EVENTS;
+
+		n = epoll_wait(epfd, epevs, max, timeout);
+		for (int i = 0; i < n; i++) {
+			evs[i].data = epevs[i].data.ptr;
+			evs[i].events = 0;
+			/* Errors and hangups are reported as readable, so the
+			** handler gets to see them through read(). */
+			if (epevs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				evs[i].events |= EV_READ;
+			if (epevs[i].events & EPOLLOUT)
+				evs[i].events |= EV_WRITE;
+		}
+		return n;
+	}
+#endif
+
+	fd_set readfds = sel_readfds, writefds = sel_writefds;
+	struct timeval tv, *ptv = nullptr;
+	int ready;
+
+	if (timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		ptv = &tv;
+	}
+
+	ready = select(sel_highest_fd + 1, &readfds, &writefds, nullptr, ptv);
+	if (ready <= 0)
+		return ready;
+
+	for (int fd = 0; fd <= sel_highest_fd && n < max && ready > 0; fd++) {
+		int events = 0;
+
+		if (FD_ISSET(fd, &readfds))
+			events |= EV_READ;
+		if (FD_ISSET(fd, &writefds))
+			events |= EV_WRITE;
+		if (!events)
+			continue;
+
+		evs[n].data = sel_data[fd];
+		evs[n].events = events;
+		n++;
+		ready--;
+	}
+
+	return n;
+}
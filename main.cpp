@@ -64,6 +64,43 @@ int detach_char = '\\' - 64;
 int no_suspend;
 /* The default redraw method. Initially set to unspecified. */
 int redraw_method = REDRAW_UNSPEC;
+/* The event engine used by the master. */
+int event_engine = ENGINE_AUTO;
+/* How the master sends the pty output to the clients. */
+#ifdef HAVE_SPLICE
+int fanout_method = FANOUT_SPLICE;
+#else
+int fanout_method = FANOUT_COPY;
+#endif
+/* The limit of the output queued for a single client, and what to do when a
+** client hits it. */
+size_t client_queue_max = CLIENT_QUEUE_MAX;
+int overflow_policy = OVERFLOW_RESYNC;
+/* How long a client may hold up the pty with the block policy, in ms. */
+unsigned block_timeout = BLOCK_TIMEOUT;
+/* What to do with the pty while no client is attached. */
+int detached_policy = DETACHED_READ;
+unsigned batch_interval = BATCH_INTERVAL;
+/* Whose window size the pty gets, and how long resizes are held back. */
+int winsize_policy = WINSIZE_RECENT;
+unsigned resize_delay = RESIZE_DELAY;
+/* The most pty output the master reads before sending it out. */
+size_t read_max = READ_MAX;
+/* The size of the shared output ring, none if 0. */
+size_t shm_ring_size;
+/* The amount of recent output the master keeps for attaching clients. */
+size_t scrollback_size;
+/* How long and how much pty output the master holds back to send it out in
+** larger pieces. */
+unsigned long coalesce_us;
+size_t coalesce_bytes = COALESCE_BYTES;
+/* The number of client slots whose pipes are created up front, and where
+** they are kept. */
+int fifo_pool;
+char *runtime_dir;
+/* The file the session is recorded to, if any, and the size of its ring. */
+char *record_name;
+size_t record_size = RECORD_SIZE;
 
 /*
 ** The original terminal settings. Shared between the master and attach
@@ -83,7 +120,10 @@ usage()
 		"       dtachez -c <socket> <options> <command...>\n"
 		"       dtachez -n <socket> <options> <command...>\n"
 		"       dtachez -N <socket> <options> <command...>\n"
+		"       dtachez -o <socket>\n"
 		"       dtachez -p <socket>\n"
+		"       dtachez -S <socket>\n"
+		"       dtachez -x <file> [<format>]\n"
 		"Modes:\n"
 		"  -a\t\tAttach to the specified socket.\n"
 		"  -A\t\tAttach to the specified socket, or create it if it\n"
@@ -94,20 +134,115 @@ usage()
 		"  -N\t\tCreate a new socket and run the specified command "
 		"detached,\n"
 		"\t\t  and have dtachez run in the foreground.\n"
+		"  -o\t\tCopy the output of the specified socket to standard "
+		"output,\n"
+		"\t\t  without attaching.\n"
 		"  -p\t\tCopy the contents of standard input to the specified\n"
 		"\t\t  socket.\n"
+		"  -S\t\tPrint the statistics of the specified socket and its "
+		"clients.\n"
+		"  -x\t\tExport the session recorded to the specified file "
+		"with -l to\n"
+		"\t\t  standard output. The valid formats are:\n"
+		"\t\t asciicast: asciinema's asciicast v2, with input and "
+		"resizes\n"
+		"\t\t\t   (default).\n"
+		"\t\t    ttyrec: ttyrec, with the output only.\n"
 		"Options:\n"
+		"  -b <size>\tRead up to <size> bytes of output from the "
+		"program before\n"
+		"\t\t  sending it out, defaults to %uk. Reads start small "
+		"and grow\n"
+		"\t\t  while the program keeps up. <size> is at most %uk.\n"
+		"  -C <usec>[,<size>]\n"
+		"\t\tHold back output for up to <usec> microseconds or "
+		"<size>\n"
+		"\t\t  bytes, defaults to %uk, and send it out at once. Output "
+		"that\n"
+		"\t\t  follows input is not held back. <size> is at most %uk.\n"
+		"  -D <policy>\tSet what the master does with the program's "
+		"output while\n"
+		"\t\t  no client is attached. The valid policies are:\n"
+		"\t\t     read: Read it as it comes (default).\n"
+		"\t\t     stop: Stop reading it, the program blocks once "
+		"the pty is\n"
+		"\t\t\t   full.\n"
+		"\t\t    batch: Read it every <msec> milliseconds with "
+		"batch,<msec>,\n"
+		"\t\t\t   which defaults to %u.\n"
 		"  -e <char>\tSet the detach character to <char>, defaults "
 		"to ^\\.\n"
 		"  -E\t\tDisable the detach character.\n"
+		"  -f <method>\tSet how the master sends output to the clients "
+		"to <method>.\n"
+		"\t\t  The valid methods are:\n"
+		"\t\t   splice: Use splice and tee, where available "
+		"(default).\n"
+		"\t\t     copy: Copy it to each client with write.\n"
+		"  -k <engine>\tSet the event engine of the master to <engine>. "
+		"The valid\n"
+		"\t\t  engines are:\n"
+		"\t\t    epoll: Use epoll, where available (default).\n"
+		"\t\t   select: Use select.\n"
+		"  -l <file>[,<size>]\n"
+		"\t\tRecord the output, input and resizes with their times to "
+		"<file>,\n"
+		"\t\t  keeping the last <size> bytes, defaults to %uM.\n"
+		"  -m <size>\tPublish the output in a shared ring of <size> "
+		"bytes, which\n"
+		"\t\t  attaching clients read by themselves.\n"
+		"  -P <count>\tCreate the pipes of the first <count> client "
+		"slots up front\n"
+		"\t\t  and reuse them, instead of creating them on every "
+		"attach.\n"
+		"  -q <size>\tLimit the output queued for a slow client to "
+		"<size> bytes,\n"
+		"\t\t  defaults to %uk.\n"
+		"  -Q <policy>\tSet what happens to a client that exceeds the "
+		"limit of -q.\n"
+		"\t\t  The valid policies are:\n"
+		"\t\t     drop: Disconnect the client.\n"
+		"\t\t   resync: Discard its queued output and redraw "
+		"(default).\n"
+		"\t\t     sync: Discard its queued output, and send it what "
+		"changed on\n"
+		"\t\t\t   the screen since, until it catches up.\n"
+		"\t\t    block: Stop reading the program's output until "
+		"it catches up.\n"
+		"\t\t\t   Disconnect it if that takes longer than "
+		"<msec> with\n"
+		"\t\t\t   block,<msec>, which defaults to %u.\n"
 		"  -r <method>\tSet the redraw method to <method>. The "
 		"valid methods are:\n"
 		"\t\t     none: Don't redraw at all.\n"
 		"\t\t   ctrl_l: Send a Ctrl L character to the program.\n"
 		"\t\t    winch: Send a WINCH signal to the program.\n"
+		"\t\t snapshot: Have the master keep track of the screen, "
+		"and paint\n"
+		"\t\t\t   it from there.\n"
+		"  -R <dir>\tKeep the pipes of -P in a private directory below "
+		"<dir>,\n"
+		"\t\t  such as a tmpfs, defaults to $XDG_RUNTIME_DIR or "
+		"/tmp.\n"
+		"  -s <size>\tKeep the last <size> bytes of output and replay "
+		"them to\n"
+		"\t\t  attaching clients instead of redrawing.\n"
+		"  -w <policy>\tSet whose window size the program gets when "
+		"several\n"
+		"\t\t  clients are attached. The valid policies are:\n"
+		"\t\t   recent: The client that was active last "
+		"(default).\n"
+		"\t\t smallest: The smallest size of them all.\n"
+		"\t\t  largest: The largest size of them all.\n"
+		"\t\t  Resizes wait until the size stays put for <msec> "
+		"milliseconds\n"
+		"\t\t  with <policy>,<msec>, which defaults to %u.\n"
 		"  -z\t\tDisable processing of the suspend key.\n"
 		"\nReport any bugs to <" PACKAGE_BUGREPORT ">.\n",
-		PACKAGE_VERSION, __DATE__, __TIME__);
+		PACKAGE_VERSION, __DATE__, __TIME__, READ_MAX / 1024,
+		READ_LIMIT / 1024, COALESCE_BYTES / 1024, READ_LIMIT / 1024,
+		BATCH_INTERVAL, RECORD_SIZE / (1024 * 1024),
+		CLIENT_QUEUE_MAX / 1024, BLOCK_TIMEOUT, RESIZE_DELAY);
 	exit(0);
 }
 
@@ -136,7 +271,8 @@ main(int argc, char **argv)
 		if (mode == '?')
 			usage();
 		else if (mode != 'a' && mode != 'c' && mode != 'n' &&
-			 mode != 'A' && mode != 'N' && mode != 'p')
+			 mode != 'A' && mode != 'N' && mode != 'o' &&
+			 mode != 'p' && mode != 'S' && mode != 'x')
 		{
 			printf("%s: Invalid mode '-%c'\n", progname, mode);
 			printf("Try '%s --help' for more information.\n",
@@ -163,6 +299,19 @@ main(int argc, char **argv)
 	sockname = *argv;
 	++argv; --argc;
 
+	if (mode == 'o')
+	{
+		if (argc > 0)
+		{
+			printf("%s: Invalid number of arguments.\n",
+			       progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		return tap_main();
+	}
+
 	if (mode == 'p')
 	{
 		if (argc > 0)
@@ -176,6 +325,32 @@ main(int argc, char **argv)
 		return push_main();
 	}
 
+	if (mode == 'S')
+	{
+		if (argc > 0)
+		{
+			printf("%s: Invalid number of arguments.\n",
+			       progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		return stats_main();
+	}
+
+	if (mode == 'x')
+	{
+		if (argc > 1)
+		{
+			printf("%s: Invalid number of arguments.\n",
+			       progname);
+			printf("Try '%s --help' for more information.\n",
+			       progname);
+			return 1;
+		}
+		return export_main(sockname, argc ? argv[0] : "asciicast");
+	}
+
 	while (argc >= 1 && **argv == '-')
 	{
 		char *p;
@@ -186,6 +361,111 @@ main(int argc, char **argv)
 				detach_char = -1;
 			else if (*p == 'z')
 				no_suspend = 1;
+			else if (*p == 'b')
+			{
+				long size;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No read size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				size = parse_size(argv[0]);
+				if (size < BUFSIZE)
+				{
+					printf("%s: Invalid read size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				read_max = size < READ_LIMIT ? size : READ_LIMIT;
+				break;
+			}
+			else if (*p == 'C')
+			{
+				char *end;
+				long usec, size = COALESCE_BYTES;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No coalescing window "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				errno = 0;
+				usec = strtol(argv[0], &end, 10);
+				if (errno || end == argv[0] || usec < 0)
+					size = -1;
+				else if (*end == ',')
+					size = parse_size(end + 1);
+				if ((*end && *end != ',') || size < BUFSIZE)
+				{
+					printf("%s: Invalid coalescing window "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				coalesce_us = usec;
+				coalesce_bytes = size < READ_LIMIT ? size : READ_LIMIT;
+				break;
+			}
+			else if (*p == 'D')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No detached policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "read") == 0)
+					detached_policy = DETACHED_READ;
+				else if (strcmp(argv[0], "stop") == 0)
+					detached_policy = DETACHED_STOP;
+				else if (strncmp(argv[0], "batch", 5) == 0 &&
+					 (!argv[0][5] || argv[0][5] == ','))
+				{
+					detached_policy = DETACHED_BATCH;
+					if (argv[0][5])
+					{
+						char *end;
+						long ms;
+
+						errno = 0;
+						ms = strtol(argv[0] + 6, &end, 10);
+						if (errno || end == argv[0] + 6 || *end ||
+						    ms <= 0 || (unsigned long)ms > UINT_MAX)
+						{
+							printf("%s: Invalid batch interval "
+							       "specified.\n", progname);
+							printf("Try '%s --help' for more "
+							       "information.\n", progname);
+							return 1;
+						}
+						batch_interval = ms;
+					}
+				}
+				else
+				{
+					printf("%s: Invalid detached policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
 			else if (*p == 'e')
 			{
 				++argv; --argc;
@@ -208,6 +488,264 @@ main(int argc, char **argv)
 					detach_char = argv[0][0];
 				break;
 			}
+			else if (*p == 'f')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No fan-out method "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "splice") == 0)
+					fanout_method = FANOUT_SPLICE;
+				else if (strcmp(argv[0], "copy") == 0)
+					fanout_method = FANOUT_COPY;
+				else
+				{
+					printf("%s: Invalid fan-out method "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'k')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No event engine "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "epoll") == 0)
+					event_engine = ENGINE_EPOLL;
+				else if (strcmp(argv[0], "select") == 0)
+					event_engine = ENGINE_SELECT;
+				else
+				{
+					printf("%s: Invalid event engine "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 'q')
+			{
+				long size;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No queue size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				size = parse_size(argv[0]);
+				if (size < BUFSIZE)
+				{
+					printf("%s: Invalid queue size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				client_queue_max = size;
+				break;
+			}
+			else if (*p == 'l')
+			{
+				char *size;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No recording file "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				size = strrchr(argv[0], ',');
+				if (size)
+				{
+					long n;
+
+					*size++ = '\0';
+					n = parse_size(size);
+					if (n < BUFSIZE || n > (1L << 30))
+					{
+						printf("%s: Invalid recording size "
+						       "specified.\n", progname);
+						printf("Try '%s --help' for more "
+						       "information.\n", progname);
+						return 1;
+					}
+					record_size = n;
+				}
+				if (!argv[0][0])
+				{
+					printf("%s: No recording file "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				record_name = argv[0];
+				break;
+			}
+			else if (*p == 'm')
+			{
+				long size;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No ring size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				size = parse_size(argv[0]);
+				if (size < BUFSIZE || size > (1L << 30))
+				{
+					printf("%s: Invalid ring size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				shm_ring_size = size;
+				break;
+			}
+			else if (*p == 'P')
+			{
+				char *end;
+				long count;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No pool size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				errno = 0;
+				count = strtol(argv[0], &end, 10);
+				if (errno || end == argv[0] || *end || count < 0 ||
+				    count > MAX_CLIENTS)
+				{
+					printf("%s: Invalid pool size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				fifo_pool = count;
+				break;
+			}
+			else if (*p == 'R')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No runtime directory "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				runtime_dir = argv[0];
+				break;
+			}
+			else if (*p == 'Q')
+			{
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No overflow policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (strcmp(argv[0], "drop") == 0)
+					overflow_policy = OVERFLOW_DROP;
+				else if (strcmp(argv[0], "resync") == 0)
+					overflow_policy = OVERFLOW_RESYNC;
+				else if (strcmp(argv[0], "sync") == 0)
+					overflow_policy = OVERFLOW_SYNC;
+				else if (strncmp(argv[0], "block", 5) == 0 &&
+					 (!argv[0][5] || argv[0][5] == ','))
+				{
+					overflow_policy = OVERFLOW_BLOCK;
+					if (argv[0][5])
+					{
+						char *end;
+						long ms;
+
+						errno = 0;
+						ms = strtol(argv[0] + 6, &end, 10);
+						if (errno || end == argv[0] + 6 || *end ||
+						    ms <= 0 || (unsigned long)ms > UINT_MAX)
+						{
+							printf("%s: Invalid block timeout "
+							       "specified.\n", progname);
+							printf("Try '%s --help' for more "
+							       "information.\n", progname);
+							return 1;
+						}
+						block_timeout = ms;
+					}
+				}
+				else
+				{
+					printf("%s: Invalid overflow policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				break;
+			}
+			else if (*p == 's')
+			{
+				long size;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No scrollback size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				size = parse_size(argv[0]);
+				if (size < 0)
+				{
+					printf("%s: Invalid scrollback size "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				scrollback_size = size;
+				break;
+			}
 			else if (*p == 'r')
 			{
 				++argv; --argc;
@@ -225,6 +763,8 @@ main(int argc, char **argv)
 					redraw_method = REDRAW_CTRL_L;
 				else if (strcmp(argv[0], "winch") == 0)
 					redraw_method = REDRAW_WINCH;
+				else if (strcmp(argv[0], "snapshot") == 0)
+					redraw_method = REDRAW_SNAPSHOT;
 				else
 				{
 					printf("%s: Invalid redraw method "
@@ -235,6 +775,56 @@ main(int argc, char **argv)
 				}
 				break;
 			}
+			else if (*p == 'w')
+			{
+				char *delay;
+
+				++argv; --argc;
+				if (argc < 1)
+				{
+					printf("%s: No window size policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				delay = strchr(argv[0], ',');
+				if (delay)
+					*delay++ = '\0';
+				if (strcmp(argv[0], "recent") == 0)
+					winsize_policy = WINSIZE_RECENT;
+				else if (strcmp(argv[0], "smallest") == 0)
+					winsize_policy = WINSIZE_SMALLEST;
+				else if (strcmp(argv[0], "largest") == 0)
+					winsize_policy = WINSIZE_LARGEST;
+				else
+				{
+					printf("%s: Invalid window size policy "
+					       "specified.\n", progname);
+					printf("Try '%s --help' for more "
+					       "information.\n", progname);
+					return 1;
+				}
+				if (delay)
+				{
+					char *end;
+					long ms;
+
+					errno = 0;
+					ms = strtol(delay, &end, 10);
+					if (errno || end == delay || *end || ms < 0 ||
+					    (unsigned long)ms > UINT_MAX)
+					{
+						printf("%s: Invalid resize delay "
+						       "specified.\n", progname);
+						printf("Try '%s --help' for more "
+						       "information.\n", progname);
+						return 1;
+					}
+					resize_delay = ms;
+				}
+				break;
+			}
 			else
 			{
 				printf("%s: Invalid option '-%c'\n",
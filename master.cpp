@@ -45,6 +45,8 @@
 
 #include "dtachez.hpp"
 
+#include <sys/wait.h>
+
 /* The pty struct - The pty information is stored here. */
 struct pty {
 	/* File descriptor of the pty */
@@ -55,8 +57,7 @@ struct pty {
 #endif
 	/* Process id of the child. */
 	pid_t pid;
-	/* The terminal parameters of the pty. Old and new for comparision
-	** purposes. */
+	/* The terminal parameters of the pty, as of the last redraw. */
 	struct termios term;
 	/* The current window size of the pty. */
 	struct winsize ws;
@@ -64,18 +65,173 @@ struct pty {
 
 /* A connected client */
 struct client {
-	int8_t index;
+	int index;
+	/* Where the client is in the active list. */
+	unsigned pos;
+	/* The next closed client waiting to be freed. */
+	struct client *next_closed;
 	/* File descriptors of the client. */
 	conn_pipes fds;
 	/* Whether or not the client is attached. */
 	bool attached;
-} __attribute__((__packed__));
+	/* Output waiting for the client's pipe to become writable. */
+	struct ring outq;
+	/* Whether the scrollback was replayed since the client attached. */
+	bool replayed;
+	/* The protocol version the client speaks. */
+	uint8_t proto;
+	/* Received data that does not make up a whole message yet. */
+	unsigned char *rxbuf;
+	size_t rxlen;
+	/* Whether output is waiting for the pipe, and since when. */
+	bool stalled;
+	uint64_t stall_since;
+	/* Whether the client fell behind and gets screen updates instead of
+	** the output, the screen it was last sent, and how much output had
+	** been sent out then. */
+	bool syncing;
+	struct screen_view *view;
+	uint64_t synced_at;
+	/* Whether the client holds up the pty with a full queue, and since
+	** when. */
+	bool full;
+	uint64_t full_since;
+	/* Whether the client's messages are left unread, because the input
+	** queue of the program is full. */
+	bool held;
+	/* Whether the client reads the output from the shared ring, whether
+	** it was sent a doorbell it did not answer yet, and how far it said
+	** it got. */
+	bool ring;
+	bool rung;
+	uint64_t acked;
+	/* Whether the client only taps the output. It gets it like an attached
+	** client, but nothing it does is seen by the program. */
+	bool tap;
+	/* How much of the output being fanned out the client took. */
+	size_t teed;
+	/* The process of the client if it told us, a pidfd that becomes
+	** readable once it exits, and whether it did. */
+	pid_t pid;
+	int pidfd;
+	bool gone;
+	/* The window size of the client if it told us, and when it last sent
+	** input or changed it. */
+	struct winsize ws;
+	bool has_ws;
+	uint64_t active_at;
+	/* Counters, reported by the stats request. */
+	struct {
+		uint64_t delivered;
+		uint64_t dropped;
+		uint64_t stall_us;
+		uint32_t syncs;
+		uint32_t msgs[MSG_OTHER + 1];
+	} stats;
+};
 
-/* The list of connected clients. */
-static struct client clients[127];
-static uint8_t nr_clients = 0;
+/*
+** The client table. It grows on demand and holds pointers, so clients stay put
+** when it does. A client is allocated while it is connected; once closed it is
+** freed after the events at hand, which may still refer to it, are handled.
+*/
+static struct client **clients;
+static unsigned clients_size;
+static unsigned nr_clients = 0;
+/* Which slots of clients are in use, one bit per slot. */
+static uint32_t *slot_map;
+/* The clients in use, packed at the front. */
+static struct client **active;
+/* The clients closed since the last wait for events. */
+static struct client *closed_clients;
+/* The number of attached clients, and how many of them only tap the
+** output. */
+static unsigned nr_attached = 0;
+static unsigned nr_taps;
 /* The pseudo-terminal created for the child process. */
 static struct pty the_pty;
+/* The number of clients with output waiting for their pipe, and since when
+** there have been any. */
+static unsigned nr_stalled;
+static uint64_t stall_since;
+/* Whether the pty is watched for output, and whether reading it is paused
+** because a client's queue is full or no client is attached. */
+static bool pty_watched, pty_paused;
+/* The number of clients with a full queue, and since when the pty has been
+** paused. */
+static unsigned nr_full;
+static uint64_t paused_since;
+/* When a detached session reads the pty next, with the batch policy. */
+static uint64_t batch_deadline;
+/* The events the pty is registered for. */
+static int pty_events;
+/* Input waiting for the pty to become writable, and the number of clients
+** that are not read until it drains. */
+static struct ring inq;
+static unsigned nr_held;
+/* How many clients the sweep checks on, and when it is due next. */
+static unsigned nr_swept;
+static uint64_t sweep_deadline;
+/* Counters of the session, reported by the stats request. */
+static struct {
+	uint64_t wakeups;
+	uint64_t pty_reads;
+	uint64_t pty_bytes;
+	/* Reads below 16, 64, 256, 1k, 4k, 16k and 64k bytes, and larger. */
+	uint64_t read_sizes[8];
+	uint64_t stall_us;
+	uint64_t dropped;
+	uint64_t paused_us;
+	uint64_t resizes;
+} stats;
+/* The most recent output of the pty, replayed to attaching clients. */
+static struct ring scrollback;
+/* Whether the scrollback has lost its oldest output. */
+static bool scrollback_wrapped;
+/* The pty output that was read but not sent out yet, and when it has to be
+** sent out at the latest. With the zero-copy fan-out, it waits in zc_pipe
+** and out_buf is only used to copy it out. Without a coalescing window,
+** out_size adapts to the output between BUFSIZE and out_max. */
+static unsigned char *out_buf;
+static size_t out_size, out_max, out_len;
+static uint64_t flush_deadline;
+/* How much output was sent out so far, which is also what the screen model
+** has seen. Output that was read but is still held back is not in it. */
+static uint64_t out_total;
+/* Whether input went to the program since the last output. */
+static bool input_forwarded;
+/* When the window size of the pty is due to be brought in line with the
+** clients. */
+static uint64_t resize_deadline;
+/* The shared output ring and its data, if there is one. */
+static struct shm_ring *shm;
+static unsigned char *shm_data;
+/* The session recording and its data, if there is one, when it started and
+** when it is due to be written back. */
+static struct rec_header *rec;
+static unsigned char *rec_data;
+static int rec_fd = -1;
+static uint64_t rec_base, rec_deadline;
+#ifdef HAVE_SPLICE
+/* The pipe the pty output is spliced into for the zero-copy fan-out, and
+** where it goes when nobody needs it anymore. */
+static int zc_pipe[2] = {-1, -1};
+static int zc_null = -1;
+#endif
+
+/* The slots whose pipes are created up front and kept open for reuse. */
+static conn_pipes pool[MAX_CLIENTS];
+static unsigned pool_size;
+/* The private directory the pool lives in, if it is not next to the socket. */
+static char *pool_dir;
+/* The pipe extended control requests come in on. */
+static int ctl_fd = -1;
+/* What tells us that the program exited: a pidfd, or the read end of a pipe
+** that SIGCHLD is written to, and its write end. Once it did, the pty is read
+** whatever the detached policy, so that the session ends. */
+static int child_fd = -1;
+static int child_signal_fd = -1;
+static bool child_exited;
 
 #ifndef HAVE_FORKPTY
 pid_t forkpty(int *amaster, char *name, struct termios *termp,
@@ -89,14 +245,28 @@ static void unlink_socket(const char *s) {
 
 static void unlink_socket(unsigned idx) {
 	unlink_socket(str_fmt("%s_%u", sockname, idx));
+	if (pool_dir && idx < pool_size)
+		unlink_socket(str_fmt("%s/%u", pool_dir, idx));
 }
 
 /* Unlink the socket */
 static void unlink_socket(void) {
 	unlink_socket(sockname);
-	for (auto &it : clients) {
-		if (it.index != -1)
-			unlink_socket(it.index);
+	unlink(str_fmt("%s_ctl", sockname));
+	for (unsigned i = 0; i < nr_clients; i++) {
+		if ((unsigned)active[i]->index >= pool_size)
+			unlink_socket((unsigned)active[i]->index);
+	}
+	for (unsigned i = 0; i < pool_size; i++)
+		unlink_socket(i);
+	if (shm) {
+		unlink(str_fmt("%s_ring", sockname));
+		if (pool_dir)
+			unlink(str_fmt("%s/ring", pool_dir));
+	}
+	if (pool_dir) {
+		unlink(str_fmt("%s_run", sockname));
+		rmdir(pool_dir);
 	}
 }
 
@@ -105,6 +275,11 @@ static RETSIGTYPE die(int sig) {
 	/* Well, the child died. */
 	if (sig == SIGCHLD)
 	{
+		int saved_errno = errno;
+
+		if (child_signal_fd != -1)
+			write(child_signal_fd, "", 1);
+		errno = saved_errno;
 #ifdef BROKEN_MASTER
 		/* Damn you Solaris! */
 		close(the_pty.fd);
@@ -208,6 +383,266 @@ static conn_pipes create_conn_pipes(const char *name, bool nonblocking) {
 	};
 }
 
+/*
+** Create the pipe for extended control requests. It is opened for writing too,
+** so that it never reports end of file, and so that a requester finds out that
+** nobody reads it when the master is gone.
+*/
+static void create_ctl_pipe(void) {
+	const char *name = str_fmt("%s_ctl", sockname);
+
+	ensure_mkfifo(name);
+	ctl_fd = ensure_open(name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+/* Create the pipes of a pooled slot, in the private directory if there is one. */
+static void create_pool_slot(unsigned idx) {
+	const char *name = str_fmt("%s_%u", sockname, idx);
+
+	if (pool_dir) {
+		const char *target = str_fmt("%s/%u", pool_dir, idx);
+
+		pool[idx] = create_conn_pipes(target, true);
+		ensure_symlink(str_fmt("%s_miso", target), str_fmt("%s_miso", name));
+		ensure_symlink(str_fmt("%s_mosi", target), str_fmt("%s_mosi", name));
+	} else {
+		pool[idx] = create_conn_pipes(name, true);
+	}
+
+#if defined(F_SETFD) && defined(FD_CLOEXEC)
+	fcntl(pool[idx].fd_miso, F_SETFD, FD_CLOEXEC);
+	fcntl(pool[idx].fd_mosi, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+/*
+** Create the pool of slot pipes. If there is a runtime directory, the pipes
+** live in a private directory below it and the usual names next to the socket
+** are symlinks to them, so clients don't need to know about it. Either way,
+** attaching and detaching a pooled slot touches no filesystem metadata.
+** Requesters find the private directory through <socket>_run, and put their
+** reply pipes there. A pool gets one even without -R, or every attach would
+** still create and remove a reply pipe next to the socket.
+*/
+static void create_pool(void) {
+	const char *dir = runtime_dir;
+
+	if (!dir && fifo_pool) {
+		dir = getenv("XDG_RUNTIME_DIR");
+		if (!dir || !*dir)
+			dir = "/tmp";
+	}
+
+	if (dir) {
+		pool_dir = strdup(str_fmt("%s/dtachez.XXXXXX", dir));
+		if (!pool_dir || !mkdtemp(pool_dir)) {
+			THROW_ERROR("failed to create runtime directory");
+		}
+		ensure_symlink(pool_dir, str_fmt("%s_run", sockname));
+	} else {
+		/* Replies would go where we don't look. */
+		unlink(str_fmt("%s_run", sockname));
+	}
+
+	for (unsigned i = 0; i < (unsigned)fifo_pool && i < MAX_CLIENTS; i++) {
+		create_pool_slot(i);
+		pool_size = i + 1;
+	}
+}
+
+/*
+** Create the shared output ring, in the private directory if there is one.
+** The size is rounded up to a power of two, and with the block policy to at
+** least two reads of BUFSIZE. Whether or not there will be one, a ring left
+** behind by a master that was killed goes first.
+*/
+static void create_shm_ring(void) {
+	const char *name = str_fmt("%s_ring", sockname);
+	size_t size = BUFSIZE;
+	int fd;
+
+	unlink(name);
+	if (!shm_ring_size)
+		return;
+
+	while (size < shm_ring_size)
+		size *= 2;
+	if (overflow_policy == OVERFLOW_BLOCK && size < 2 * BUFSIZE)
+		size = 2 * BUFSIZE;
+
+	if (pool_dir) {
+		const char *target = str_fmt("%s/ring", pool_dir);
+
+		fd = open(target, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		ensure_symlink(target, name);
+	} else {
+		fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	}
+
+	if (fd < 0 || ftruncate(fd, sizeof(struct shm_ring) + size) < 0) {
+		THROW_ERROR("failed to create output ring");
+	}
+
+	shm = (struct shm_ring *)mmap(nullptr, sizeof(struct shm_ring) + size,
+				      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm = nullptr;
+		THROW_ERROR("failed to map output ring");
+	}
+
+	shm_data = (unsigned char *)(shm + 1);
+	shm->size = size;
+	shm->magic = SHM_RING_MAGIC;
+}
+
+/*
+** Publish output in the shared ring. The claim goes out before the data, so
+** that a reader copying what gets overwritten finds out.
+*/
+static void publish(const unsigned char *buf, size_t len) {
+	uint64_t head = shm->head;
+	size_t size = shm->size, off, n;
+
+	__atomic_store_n(&shm->claim, head + len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Only the last size bytes survive anyway. */
+	if (len > size) {
+		head += len - size;
+		buf += len - size;
+		len = size;
+	}
+
+	off = head & (size - 1);
+	n = len < size - off ? len : size - off;
+	memcpy(shm_data + off, buf, n);
+	memcpy(shm_data, buf + n, len - n);
+
+	__atomic_store_n(&shm->head, head + len, __ATOMIC_RELEASE);
+}
+
+/*
+** Create the session recording. The size is rounded up to a power of two. The
+** file stays open, to start writing it back with.
+*/
+static void create_recording(void) {
+	size_t size = BUFSIZE;
+	struct timespec ts;
+
+	if (!record_name)
+		return;
+
+	while (size < record_size)
+		size *= 2;
+
+	rec_fd = open(record_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (rec_fd < 0 || ftruncate(rec_fd, sizeof(struct rec_header) + size) < 0) {
+		THROW_ERROR("failed to create recording");
+	}
+
+	rec = (struct rec_header *)mmap(nullptr, sizeof(struct rec_header) + size,
+					PROT_READ | PROT_WRITE, MAP_SHARED, rec_fd, 0);
+	if (rec == MAP_FAILED) {
+		rec = nullptr;
+		THROW_ERROR("failed to map recording");
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec_base = now_us();
+	rec_data = (unsigned char *)(rec + 1);
+	rec->size = size;
+	rec->start = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec->magic = REC_MAGIC;
+}
+
+/* Copy data into the recording at seq, wrapping around its end. */
+static void rec_copy(uint64_t seq, const void *buf, size_t len) {
+	size_t size = rec->size, off = seq & (size - 1);
+	size_t n = len < size - off ? len : size - off;
+
+	memcpy(rec_data + off, buf, n);
+	memcpy(rec_data, (const unsigned char *)buf + n, len - n);
+}
+
+/*
+** Append an event to the recording. This is on the way of every piece of
+** output, so it only copies into the mapping: the kernel writes it back on its
+** own, and flush_recording() gives it a push every RECORD_SYNC_INTERVAL.
+*/
+static void record(int type, const void *buf, size_t len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	/* Split up what would take a good part of the ring by itself. */
+	size_t max = rec->size / 4 - sizeof(struct rec_event);
+	struct rec_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.time = now_us() - rec_base;
+	ev.type = type;
+
+	do {
+		uint64_t head = rec->head, tail = rec->tail;
+		size_t n = len < max ? len : max;
+
+		/* Drop the oldest events to make room, keeping track of the
+		** window size as of the new oldest one. */
+		while (head + REC_SPACE(n) - tail > rec->size) {
+			auto old = (struct rec_event *)(rec_data + (tail & (rec->size - 1)));
+
+			if (old->type == REC_RESIZE && old->len == 4) {
+				uint16_t ws[2];
+
+				memcpy(ws, old + 1, sizeof(ws));
+				rec->rows = ws[0];
+				rec->cols = ws[1];
+			}
+			tail += REC_SPACE(old->len);
+		}
+		__atomic_store_n(&rec->tail, tail, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		ev.len = n;
+		rec_copy(head, &ev, sizeof(ev));
+		rec_copy(head + sizeof(ev), p, n);
+		__atomic_store_n(&rec->head, head + REC_SPACE(n), __ATOMIC_RELEASE);
+
+		p += n;
+		len -= n;
+	} while (len);
+
+	if (!rec_deadline)
+		rec_deadline = now_us() + RECORD_SYNC_INTERVAL * 1000;
+}
+
+/* Record a change of the window size. */
+static void record_resize(const struct winsize *ws) {
+	uint16_t data[2] = {ws->ws_row, ws->ws_col};
+
+	record(REC_RESIZE, data, sizeof(data));
+}
+
+/*
+** Start writing back what was recorded since the last time, without waiting
+** for it. Nothing here ever waits for the disk: where sync_file_range() is not
+** around, it is left to the kernel.
+*/
+static void flush_recording(void) {
+	rec_deadline = 0;
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(rec_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#else
+	msync(rec, sizeof(struct rec_header) + rec->size, MS_ASYNC);
+#endif
+}
+
+/* Close the pool in processes that are not the master. */
+static void close_pool(void) {
+	for (unsigned i = 0; i < pool_size; i++) {
+		close(pool[i].fd_miso);
+		close(pool[i].fd_mosi);
+	}
+}
+
 /* Update the modes on the socket. */
 static void
 update_socket_modes(int exec)
@@ -227,245 +662,1665 @@ update_socket_modes(int exec)
 		chmod(sockname, newmode);
 }
 
-/* Process activity on the pty - Input and terminal changes are sent out to
-** the attached clients. If the pty goes away, we die. */
-static void pty_activity(const conn_pipes &s) {
-	unsigned char buf[BUFSIZE];
-	ssize_t len;
-	fd_set readfds, writefds;
-	int highest_fd, nclients = 0;
-	unsigned cnt = 0;
+/*
+** Stop or resume reading the pty, depending on whether a client's queue is
+** full or, with a detached policy, no client is attached and the program is
+** still around, and watch it for room while input is queued. Without either,
+** the pty is taken out of the event engine altogether, as epoll reports
+** hangups regardless of the events asked for. The batch policy reads it on a
+** timer instead.
+*/
+static void update_pty(void) {
+	bool detached = !nr_attached && detached_policy != DETACHED_READ &&
+		!child_exited;
+	bool paused = nr_full || detached;
+	int events;
+
+	if (detached && !nr_full && detached_policy == DETACHED_BATCH) {
+		if (!batch_deadline)
+			batch_deadline = now_us() + (uint64_t)batch_interval * 1000;
+	} else {
+		batch_deadline = 0;
+	}
 
-	/* Read the pty activity */
-	len = read(the_pty.fd, buf, sizeof(buf));
+	if (pty_paused != paused) {
+		pty_paused = paused;
+		if (paused)
+			paused_since = now_us();
+		else
+			stats.paused_us += now_us() - paused_since;
+	}
 
-	/* Error -> die */
-	if (len <= 0)
-		exit(1);
+	if (!pty_watched)
+		return;
 
-#ifdef BROKEN_MASTER
-	/* Get the current terminal settings. */
-	if (tcgetattr(the_pty.slave, &the_pty.term) < 0)
-		exit(1);
-#else
-	/* Get the current terminal settings. */
-	if (tcgetattr(the_pty.fd, &the_pty.term) < 0)
-		exit(1);
+	/* Queued input needs the pty to be writable, paused or not. */
+	events = (paused ? 0 : EV_READ) | (inq.len ? EV_WRITE : 0);
+	if (events == pty_events)
+		return;
+
+	if (!events)
+		ev_del(the_pty.fd);
+	else if ((pty_events ? ev_mod : ev_add)(the_pty.fd, events, &the_pty))
+		THROW_ERROR("failed to watch pty");
+	pty_events = events;
+}
+
+/* Start watching the pty. */
+static void watch_pty(void) {
+	pty_watched = true;
+	update_pty();
+}
+
+/*
+** Note whether the program exited. The pipe is also written to when it merely
+** stopped, so ask without reaping it. Once it is gone, the pty is read until
+** it reports the hangup, like it is when a client is attached.
+*/
+static void child_activity(void) {
+	siginfo_t info;
+
+	if (child_signal_fd != -1)
+		drain_fd(child_fd);
+
+	memset(&info, 0, sizeof(info));
+	if (waitid(P_PID, the_pty.pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+	    !info.si_pid)
+		return;
+
+	ev_del(child_fd);
+	if (child_signal_fd != -1) {
+		close(child_signal_fd);
+		child_signal_fd = -1;
+	}
+	close(child_fd);
+	child_fd = -1;
+
+	child_exited = true;
+	update_pty();
+}
+
+/*
+** Watch for the program to exit, which the pty does not tell while it is not
+** read. A pidfd tells us, and SIGCHLD does where there is none.
+*/
+static void watch_child(void) {
+#ifdef SYS_pidfd_open
+	child_fd = syscall(SYS_pidfd_open, the_pty.pid, 0);
 #endif
+	if (child_fd < 0) {
+		int fd[2];
 
-top:
-	/*
-	** Wait until at least one client is writable. Also wait on the control
-	** socket in case a new client tries to connect.
-	*/
-	FD_ZERO(&readfds);
-	FD_ZERO(&writefds);
-	FD_SET(s.fd_miso, &readfds);
-	highest_fd = s.fd_miso;
-	cnt = 0;
-	for (auto &it : clients) {
-		if (it.index != -1) {
-			cnt++;
-			if (!it.attached)
-				continue;
-			FD_SET(it.fds.fd_mosi, &writefds);
-			if (it.fds.fd_mosi > highest_fd)
-				highest_fd = it.fds.fd_mosi;
-			nclients++;
-		}
+		if (pipe2(fd, O_NONBLOCK | O_CLOEXEC) < 0)
+			return;
+		child_fd = fd[0];
+		child_signal_fd = fd[1];
+	}
 
-		if (cnt >= nr_clients) {
-			break;
-		}
+	if (ev_add(child_fd, EV_READ, &child_fd)) {
+		THROW_ERROR("failed to set up event engine");
 	}
 
-	if (nclients == 0)
-		return;
+	/* It may have exited before there was anything to tell us. */
+	child_activity();
+}
+
+/* How much of the shared ring a ring client has yet to say it read. */
+static uint64_t ring_behind(struct client *p) {
+	return p->ring ? shm->head - p->acked : 0;
+}
+
+/*
+** With the block policy, note whether a client's queue is full. The pty is
+** not read while any is, so the program has to wait for the client. It is
+** resumed once the queue is down to half. A ring client is full as well once
+** another read could overwrite what it did not read yet, and resumed once it
+** caught up to half of what it may lag behind.
+*/
+static void update_full(struct client *p) {
+	bool full = p->full;
+	uint64_t lag = p->ring ? shm->size - out_max : 0;
 
-	if (select(highest_fd + 1, &readfds, &writefds, nullptr, nullptr) < 0)
+	if (overflow_policy != OVERFLOW_BLOCK)
 		return;
 
-	/* Send the data out to the clients. */
-	cnt = 0;
-	for (auto &it : clients) {
-		if (it.index != -1) {
-			cnt++;
+	if (p->attached && (p->outq.len >= client_queue_max ||
+			    ring_behind(p) > lag))
+		full = true;
+	else if (!p->attached || (p->outq.len <= client_queue_max / 2 &&
+				  ring_behind(p) <= lag / 2))
+		full = false;
 
-			ssize_t written;
+	if (p->full == full)
+		return;
 
-			if (!FD_ISSET(it.fds.fd_mosi, &writefds))
-				continue;
+	p->full = full;
+	if (full) {
+		p->full_since = now_us();
+		nr_full++;
+	} else {
+		nr_full--;
+	}
 
-			written = 0;
-			while (written < len) {
-				ssize_t n = write(it.fds.fd_mosi, buf + written, len - written);
+	update_pty();
+}
 
-				if (n > 0) {
-					written += n;
-					continue;
-				} else if (n < 0 && errno == EINTR)
-					continue;
-				else if (n < 0 && errno != EAGAIN)
-					nclients = -1;
-				break;
-			}
+/*
+** Have the window size of the pty brought in line with the clients once it
+** stays put for resize_delay. A terminal being resized sends a burst of
+** changes, and the program only has to redraw for the last of them.
+*/
+static void schedule_resize(void) {
+	resize_deadline = now_us() + (uint64_t)resize_delay * 1000;
+}
 
-			if (nclients != -1 && written == len)
-				nclients++;
+/* Mark a client as attached or detached, keeping nr_attached in sync. */
+static void set_attached(struct client *p, bool attached) {
+	if (p->attached == attached)
+		return;
 
+	p->attached = attached;
+	if (attached) {
+		nr_attached++;
+	} else {
+		nr_attached--;
+		if (p->tap) {
+			p->tap = false;
+			nr_taps--;
 		}
+		p->syncing = false;
+		screen_view_free(p->view);
+		p->view = nullptr;
+		update_full(p);
+
+		/* Its size no longer counts. */
+		if (p->has_ws)
+			schedule_resize();
+	}
 
-		if (cnt >= nr_clients) {
+	update_pty();
+}
+
+/* Note whether a client has output waiting for its pipe, and only ask for
+** writability while it does. */
+static int set_stalled(struct client *p, bool stalled) {
+	uint64_t now;
+
+	if (p->stalled == stalled)
+		return 0;
+
+	now = now_us();
+	p->stalled = stalled;
+	if (stalled) {
+		p->stall_since = now;
+		if (nr_stalled++ == 0)
+			stall_since = now;
+	} else {
+		p->stats.stall_us += now - p->stall_since;
+		if (--nr_stalled == 0)
+			stats.stall_us += now - stall_since;
+	}
+
+	return ev_mod(p->fds.fd_mosi, stalled ? EV_WRITE : 0, p);
+}
+
+/* Make room for another 32 slots in the client table, or twice as many. */
+static void grow_clients(void) {
+	unsigned size = clients_size ? clients_size * 2 : 32;
+	struct client **c, **a;
+	uint32_t *m;
+
+	if (size > MAX_CLIENTS_WIDE)
+		size = MAX_CLIENTS_WIDE;
+
+	c = (struct client **)realloc(clients, size * sizeof(*c));
+	if (c)
+		clients = c;
+	a = (struct client **)realloc(active, size * sizeof(*a));
+	if (a)
+		active = a;
+	m = (uint32_t *)realloc(slot_map, size / 32 * sizeof(*m));
+	if (m)
+		slot_map = m;
+	if (!c || !a || !m) {
+		THROW_ERROR("out of memory");
+	}
+
+	memset(clients + clients_size, 0, (size - clients_size) * sizeof(*c));
+	memset(slot_map + clients_size / 32, 0, (size - clients_size) / 32 * sizeof(*m));
+	clients_size = size;
+}
+
+/* Take the lowest free slot below limit. Returns -1 if there is none. */
+static int alloc_slot(unsigned limit) {
+	unsigned idx = clients_size;
+	struct client *p;
+
+	for (unsigned i = 0; i < clients_size / 32; i++) {
+		if (slot_map[i] != UINT32_MAX) {
+			idx = i * 32 + __builtin_ctz(~slot_map[i]);
 			break;
 		}
 	}
 
-	/* Try again if nothing happened. */
-	if (!FD_ISSET(s.fd_miso, &readfds) && nclients == 0)
-		goto top;
+	if (idx >= limit)
+		return -1;
+	if (idx == clients_size)
+		grow_clients();
+
+	p = (struct client *)calloc(1, sizeof(*p));
+	if (!p) {
+		THROW_ERROR("out of memory");
+	}
+
+	slot_map[idx / 32] |= 1U << (idx % 32);
+	p->index = idx;
+	p->pos = nr_clients;
+	p->pidfd = -1;
+	active[nr_clients++] = p;
+	clients[idx] = p;
+	return idx;
 }
 
-/* Process activity on the control socket */
-static void control_activity(const conn_pipes &fd_main_pipe) {
-	uint8_t ctrl_byte;
+/* Give back the slot of a client. */
+static void free_slot(struct client *p) {
+	struct client *last = active[--nr_clients];
 
-	if (read(fd_main_pipe.fd_miso, &ctrl_byte, 1) != 1) {
-		THROW_ERROR("failed to read main pipe");
-	}
+	/* Move the last active client into the hole. */
+	active[p->pos] = last;
+	last->pos = p->pos;
 
-	bool is_create = (ctrl_byte & (1 << 7)) != 0;
-	uint8_t req_index = ctrl_byte & 0x7f;
+	slot_map[p->index / 32] &= ~(1U << (p->index % 32));
+	clients[p->index] = nullptr;
+	p->index = -1;
 
-	if (is_create) {
-		uint8_t new_index = 0;
+	p->next_closed = closed_clients;
+	closed_clients = p;
+}
 
-		for (auto &it : clients) {
-			if (it.index != -1) {
-				new_index++;
-			} else {
-				break;
-			}
-		}
+/* Free the clients closed while handling the last events. */
+static void free_closed_clients(void) {
+	while (closed_clients) {
+		struct client *p = closed_clients;
 
-		if (new_index < 127) {
-			auto &cl = clients[new_index];
+		closed_clients = p->next_closed;
+		free(p);
+	}
+}
 
-			cl.index = (int8_t)new_index;
-			cl.fds = create_conn_pipes(str_fmt("%s_%u", sockname, new_index), true);
-			cl.attached = false;
+/* Stop or resume reading a client's messages. */
+static void set_held(struct client *p, bool held) {
+	if (p->held == held)
+		return;
 
-			nr_clients++;
-		}
+	p->held = held;
+	if (held)
+		nr_held++;
+	else
+		nr_held--;
 
-		if (write(fd_main_pipe.fd_mosi, &new_index, 1) != 1) {
-			THROW_ERROR("failed to write main pipe");
-		}
+	ev_mod(p->fds.fd_miso, held ? 0 : EV_READ, p);
+}
 
+/* Events on the pidfd of a client carry the client with the lowest bit set,
+** which its alignment leaves free. */
+static void *pidfd_tag(struct client *p) {
+	return (char *)p + 1;
+}
 
+/*
+** Find out when the process of a client exits. A pidfd tells us right away,
+** without costing a wakeup before then. Where there is none, the sweep checks
+** on the client every LIVENESS_INTERVAL.
+*/
+static void watch_pid(struct client *p, pid_t pid) {
+	p->pid = pid;
+	p->pidfd = -1;
+	p->gone = false;
+	if (pid <= 0)
+		return;
 
-//		printf("opened client %u\n", new_index);
-	} else {
-		auto &cl = clients[req_index];
+#ifdef SYS_pidfd_open
+	p->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (p->pidfd >= 0 && ev_add(p->pidfd, EV_READ, pidfd_tag(p))) {
+		close(p->pidfd);
+		p->pidfd = -1;
+	}
+#endif
 
-		if (cl.index == req_index) {
-			cl.index = -1;
-			cl.attached = false;
-			close(cl.fds.fd_miso);
-			close(cl.fds.fd_mosi);
-			unlink_socket((unsigned)req_index);
-			nr_clients--;
+	if (p->pidfd < 0) {
+		/* Not a process we can see, don't guess. */
+		if (kill(pid, 0) < 0 && errno == ESRCH) {
+			p->pid = 0;
+			return;
 		}
+		nr_swept++;
+		if (!sweep_deadline)
+			sweep_deadline = now_us() + LIVENESS_INTERVAL * 1000;
+	}
+}
 
-//		printf("closed client %u\n", req_index);
+static void unwatch_pid(struct client *p) {
+	if (p->pidfd >= 0) {
+		ev_del(p->pidfd);
+		close(p->pidfd);
+		p->pidfd = -1;
+	} else if (p->pid > 0 && !p->gone) {
+		nr_swept--;
 	}
+	p->pid = 0;
+	p->gone = false;
 }
 
-/* Process activity from a client. */
-static int client_activity(struct client *p) {
-	ssize_t len;
-	struct packet pkt;
+/* The client whose pidfd an event is for, if it is for one. */
+static struct client *pidfd_owner(void *data) {
+	if (!((uintptr_t)data & 1))
+		return nullptr;
 
-	/* Read the activity. */
-	len = read(p->fds.fd_miso, &pkt, sizeof(struct packet));
-	if (len < 0 && (errno == EAGAIN || errno == EINTR))
-		return 0;
+	return (struct client *)((char *)data - 1);
+}
 
-	/* Close the client on an error. */
-	if (len <= 0) {
+/* Whether a client has nothing left in its pipe for us to read. */
+static bool drained(struct client *p) {
+	int n = 0;
+
+	return ioctl(p->fds.fd_miso, FIONREAD, &n) < 0 || n == 0;
+}
+
+/*
+** Close a client and release its slot. The pipes of a pooled slot are kept
+** for the next client if this one is done with them. Otherwise they are
+** replaced with new ones, so that a client that still has the old ones open
+** sees them end rather than sharing the slot with the next one.
+*/
+static void release_client(struct client *p, bool reuse) {
+	unsigned idx = p->index;
+
+	set_stalled(p, false);
+	set_held(p, false);
+	p->ring = p->rung = false;
+	unwatch_pid(p);
+	ev_del(p->fds.fd_miso);
+	ev_del(p->fds.fd_mosi);
+
+	if (idx < pool_size && reuse) {
+		/* Keep the pipes for the next client, just empty them. */
+		drain_fd(p->fds.fd_miso);
+		drain_fd(p->fds.fd_mosi);
+	} else {
 		close(p->fds.fd_miso);
 		close(p->fds.fd_mosi);
-		return -1;
+		unlink_socket(idx);
+		if (idx < pool_size)
+			create_pool_slot(idx);
 	}
 
-	/* Push out data to the program. */
-	if (pkt.type == MSG_PUSH) {
-		if (pkt.len <= sizeof(pkt.u.buf))
-			write(the_pty.fd, pkt.u.buf, pkt.len);
-	}
+	ring_free(&p->outq);
+	free(p->rxbuf);
+	p->rxbuf = nullptr;
+	p->rxlen = 0;
+	set_attached(p, false);
+	free_slot(p);
+}
 
-		/* Attach or detach from the program. */
-	else if (pkt.type == MSG_ATTACH)
-		p->attached = true;
-	else if (pkt.type == MSG_DETACH)
-		p->attached = false;
+/* Close a client that said goodbye, or whose process is gone. */
+static void close_client(struct client *p) {
+	release_client(p, true);
+}
 
-		/* Window size change request, without a forced redraw. */
-	else if (pkt.type == MSG_WINCH)
-	{
-		the_pty.ws = pkt.u.ws;
-		ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
-	}
+/* Close a client on our own, which may still be around to use its pipes. */
+static void drop_client(struct client *p) {
+	release_client(p, false);
+}
 
-		/* Force a redraw using a particular method. */
-	else if (pkt.type == MSG_REDRAW)
-	{
-		int method = pkt.len;
+/*
+** The process of a client exited without saying goodbye. Whatever it sent
+** before is still passed on, the client is closed once its pipe is empty.
+** Returns whether it was.
+*/
+static bool client_gone(struct client *p) {
+	if (p->pidfd >= 0) {
+		ev_del(p->pidfd);
+		close(p->pidfd);
+		p->pidfd = -1;
+	} else {
+		nr_swept--;
+	}
+	p->gone = true;
 
-		/* If the client didn't specify a particular method, use
-		** whatever we had on startup. */
-		if (method == REDRAW_UNSPEC)
-			method = redraw_method;
-		if (method == REDRAW_NONE)
-			return 0;
+	if (!drained(p))
+		return false;
 
-		/* Set the window size. */
-		the_pty.ws = pkt.u.ws;
-		ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+	close_client(p);
+	return true;
+}
 
-		/* Send a ^L character if the terminal is in no-echo and
-		** character-at-a-time mode. */
-		if (method == REDRAW_CTRL_L)
-		{
-			char c = '\f';
+/* Check on the clients that have no pidfd. */
+static void sweep_pids(void) {
+	for (unsigned i = 0; i < nr_clients; ) {
+		auto &it = *active[i];
 
-			if (((the_pty.term.c_lflag & (ECHO|ICANON)) == 0) &&
-			    (the_pty.term.c_cc[VMIN] == 1))
-			{
-				write(the_pty.fd, &c, 1);
-			}
-		}
-			/* Send a WINCH signal to the program. */
-		else if (method == REDRAW_WINCH)
-		{
-			killpty(&the_pty, SIGWINCH);
+		if (it.pid > 0 && it.pidfd < 0 && !it.gone &&
+		    kill(it.pid, 0) < 0 && errno == ESRCH && client_gone(&it)) {
+			/* The last one takes its place in active[]. */
+			continue;
 		}
+		i++;
 	}
 
-	return 0;
+	sweep_deadline = nr_swept ? now_us() + LIVENESS_INTERVAL * 1000 : 0;
 }
 
-/* The master process - It watches over the pty process and the attached */
-/* clients. */
-static void master_process(const conn_pipes &fd_main_pipe, char **argv, int waitattach, int statusfd) {
-	fd_set readfds;
-	int highest_fd;
-	int nullfd;
-	uint8_t cnt = 0;
+/*
+** Write to the program. What the pty does not take right away is queued, and
+** written once it has room. Output keeps flowing meanwhile.
+*/
+static void write_pty(const void *buf, size_t len) {
+	ssize_t n = 0;
+
+	/* Keep the ordering: nothing jumps ahead of queued input. */
+	if (!inq.len) {
+		do
+			n = write(the_pty.fd, buf, len);
+		while (n < 0 && errno == EINTR);
+
+		/* The program is gone, the read side finds out. */
+		if (n < 0 && errno != EAGAIN)
+			return;
+		if (n < 0)
+			n = 0;
+	}
 
-	for (auto &it : clients) {
-		it.index = -1;
-		it.attached = false;
+	if ((size_t)n < len) {
+		ring_push(&inq, (const uint8_t *)buf + n, len - n, SIZE_MAX);
+		update_pty();
 	}
+}
+
+/*
+** Write queued input once the pty has room. When the queue is down to half,
+** the clients that were held up are read again.
+*/
+static void flush_input(void) {
+	struct iovec iov[2];
+	int iovcnt;
+
+	while ((iovcnt = ring_peek(&inq, iov)) > 0) {
+		ssize_t n = writev(the_pty.fd, iov, iovcnt);
+
+		if (n > 0) {
+			ring_consume(&inq, n);
+			continue;
+		} else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+			break;
+
+		/* The program is gone, the read side finds out. */
+		ring_clear(&inq);
+		break;
+	}
+
+	if (nr_held && inq.len <= INPUT_QUEUE_MAX / 2) {
+		for (unsigned i = 0; i < nr_clients; i++)
+			set_held(active[i], false);
+	}
+
+	update_pty();
+}
+
+/*
+** Read the terminal parameters of the pty. Only the ctrl_l redraw needs them,
+** so they are read when it does rather than after every read of the output.
+*/
+static void update_term(void) {
+#ifdef BROKEN_MASTER
+	if (tcgetattr(the_pty.slave, &the_pty.term) < 0)
+		exit(1);
+#else
+	if (tcgetattr(the_pty.fd, &the_pty.term) < 0)
+		exit(1);
+#endif
+}
+
+/* Force a redraw of the program using a particular method. */
+static void redraw_pty(int method) {
+	/* Send a ^L character if the terminal is in no-echo and
+	** character-at-a-time mode. */
+	if (method == REDRAW_CTRL_L)
+	{
+		char c = '\f';
+
+		update_term();
+		if (((the_pty.term.c_lflag & (ECHO|ICANON)) == 0) &&
+		    (the_pty.term.c_cc[VMIN] == 1))
+		{
+			write_pty(&c, 1);
+		}
+	}
+		/* Send a WINCH signal to the program. */
+	else if (method == REDRAW_WINCH)
+	{
+		killpty(&the_pty, SIGWINCH);
+	}
+}
+
+/* The window size the attached clients get under the policy, if any of them
+** told us theirs. */
+static const struct winsize *pick_winsize(void) {
+	static struct winsize ws;
+	const struct client *recent = nullptr;
+
+	for (unsigned i = 0; i < nr_clients; i++) {
+		auto &it = *active[i];
+
+		if (!it.attached || !it.has_ws)
+			continue;
+
+		if (!recent) {
+			ws = it.ws;
+		} else if (winsize_policy == WINSIZE_SMALLEST) {
+			ws.ws_row = it.ws.ws_row < ws.ws_row ? it.ws.ws_row : ws.ws_row;
+			ws.ws_col = it.ws.ws_col < ws.ws_col ? it.ws.ws_col : ws.ws_col;
+		} else if (winsize_policy == WINSIZE_LARGEST) {
+			ws.ws_row = it.ws.ws_row > ws.ws_row ? it.ws.ws_row : ws.ws_row;
+			ws.ws_col = it.ws.ws_col > ws.ws_col ? it.ws.ws_col : ws.ws_col;
+		}
+		if (!recent || it.active_at > recent->active_at)
+			recent = &it;
+	}
+
+	if (!recent)
+		return nullptr;
+	if (winsize_policy == WINSIZE_RECENT)
+		return &recent->ws;
+
+	/* The pixel sizes no longer go with the cells. */
+	ws.ws_xpixel = ws.ws_ypixel = 0;
+	return &ws;
+}
+
+/*
+** Resize the pty to the size picked for the clients. Returns whether the size
+** changed, which has the kernel send the program a SIGWINCH already.
+*/
+static bool apply_resize(void) {
+	const struct winsize *ws = pick_winsize();
+
+	resize_deadline = 0;
+	if (!ws || memcmp(ws, &the_pty.ws, sizeof(*ws)) == 0)
+		return false;
+
+	the_pty.ws = *ws;
+	ioctl(the_pty.fd, TIOCSWINSZ, &the_pty.ws);
+	screen_resize(the_pty.ws.ws_row, the_pty.ws.ws_col);
+	if (rec)
+		record_resize(&the_pty.ws);
+	stats.resizes++;
+	return true;
+}
+
+/* Queue what changed on the screen since a syncing client was last sent it. */
+static void queue_sync(struct client *p) {
+	size_t len;
+	char *buf = screen_sync(&p->view, &len);
+
+	ring_push(&p->outq, buf, len, len > client_queue_max ? len : client_queue_max);
+	p->synced_at = out_total;
+	free(buf);
+}
+
+/*
+** Write as much of the client's queued output as its pipe takes. Once a
+** syncing client took everything, it either gets the next screen update, or
+** goes back to the output if there was none since.
+*/
+static int flush_client(struct client *p) {
+	struct iovec iov[2];
+	int iovcnt;
+
+	for (;;) {
+		while ((iovcnt = ring_peek(&p->outq, iov)) > 0) {
+			ssize_t n = writev(p->fds.fd_mosi, iov, iovcnt);
+
+			if (n > 0) {
+				ring_consume(&p->outq, n);
+				p->stats.delivered += n;
+				continue;
+			} else if (n < 0 && errno == EINTR)
+				continue;
+			else if (n < 0 && errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		if (p->outq.len || !p->syncing)
+			break;
+
+		if (p->view && p->synced_at == out_total) {
+			p->syncing = false;
+			break;
+		}
+
+		queue_sync(p);
+	}
+
+	update_full(p);
+	return set_stalled(p, p->outq.len != 0);
+}
+
+/* Keep the pty output in the scrollback, dropping the oldest when full. */
+static void save_scrollback(const unsigned char *buf, size_t len) {
+	if (len > scrollback_size) {
+		buf += len - scrollback_size;
+		len = scrollback_size;
+	}
+
+	if (scrollback.len + len > scrollback_size) {
+		ring_consume(&scrollback, scrollback.len + len - scrollback_size);
+		scrollback_wrapped = true;
+	}
+
+	ring_push(&scrollback, buf, len, scrollback_size);
+}
+
+/*
+** Queue output for a client. Ring clients get it in MSG_PUSH frames, as their
+** pipe carries the frames of the ring too. Either all of it fits within the
+** limit, or none of it is queued.
+*/
+static int queue_out(struct client *p, const void *buf, size_t len, size_t limit) {
+	auto data = (const uint8_t *)buf;
+	size_t frames = (len + FRAME_MAX - 1) / FRAME_MAX;
+
+	if (!p->ring)
+		return ring_push(&p->outq, buf, len, limit);
+
+	if (p->outq.len + len + frames * sizeof(struct frame) > limit)
+		return -1;
+
+	while (len) {
+		struct frame hdr;
+
+		hdr.type = MSG_PUSH;
+		hdr.arg = 0;
+		hdr.len = len < FRAME_MAX ? len : FRAME_MAX;
+		ring_push(&p->outq, &hdr, sizeof(hdr), SIZE_MAX);
+		ring_push(&p->outq, data, hdr.len, SIZE_MAX);
+		data += hdr.len;
+		len -= hdr.len;
+	}
+
+	return 0;
+}
+
+/* Answer a client that asked for the ring, with whether it gets it. */
+static void queue_ring_answer(struct client *p) {
+	struct frame hdr;
+
+	hdr.type = MSG_ATTACH;
+	hdr.arg = p->ring ? ATTACH_RING : ATTACH_PLAIN;
+	hdr.len = 0;
+	ring_push(&p->outq, &hdr, sizeof(hdr), SIZE_MAX);
+}
+
+/* Tell a ring client where in the ring to carry on, after what is queued. */
+static void queue_ring_start(struct client *p) {
+	unsigned char buf[sizeof(struct frame) + sizeof(uint64_t)];
+	struct frame hdr;
+
+	hdr.type = MSG_RING;
+	hdr.arg = 0;
+	hdr.len = sizeof(uint64_t);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &shm->head, sizeof(uint64_t));
+	ring_push(&p->outq, buf, sizeof(buf), SIZE_MAX);
+
+	/* It answers that one, like a doorbell. */
+	p->rung = true;
+	p->acked = shm->head;
+}
+
+/*
+** Wake up a ring client that caught up. There is no need if its pipe has
+** something for it already: it looks at the ring whenever it reads the pipe.
+*/
+static void ring_doorbell(struct client *p) {
+	struct frame hdr;
+
+	p->rung = true;
+	if (p->outq.len)
+		return;
+
+	hdr.type = MSG_RING;
+	hdr.arg = 0;
+	hdr.len = 0;
+	write(p->fds.fd_mosi, &hdr, sizeof(hdr));
+}
+
+/*
+** Queue the scrollback for a client. If the beginning of it is gone, start at
+** the next line so that we don't begin in the middle of an escape sequence.
+** At most half of the client's queue is used, leaving room for live output.
+*/
+static void queue_scrollback(struct client *p) {
+	struct iovec iov[2];
+	int iovcnt = ring_peek(&scrollback, iov);
+	bool seek_line = scrollback_wrapped;
+	size_t skip = 0;
+
+	if (scrollback.len > client_queue_max / 2) {
+		skip = scrollback.len - client_queue_max / 2;
+		seek_line = true;
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		auto base = (unsigned char *)iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+
+		base += skip;
+		len -= skip;
+		skip = 0;
+
+		if (seek_line) {
+			auto nl = (unsigned char *)memchr(base, '\n', len);
+
+			if (!nl)
+				continue;
+
+			len -= nl + 1 - base;
+			base = nl + 1;
+			seek_line = false;
+		}
+
+		queue_out(p, base, len, client_queue_max);
+	}
+}
+
+/*
+** Queue a picture of the screen for a client, in place of whatever it still
+** has queued: the picture is newer. A cancel goes first, in case the pipe
+** took half of an escape sequence. The queue of a ring client holds frames,
+** which must not be cut, so it gets the picture after them.
+*/
+static void queue_snapshot(struct client *p) {
+	size_t len;
+	char *buf = screen_snapshot(&len);
+
+	if (!p->ring)
+		ring_clear(&p->outq);
+
+	/* Unless it does not read its pipe at all. */
+	if (p->outq.len <= client_queue_max) {
+		queue_out(p, "\30", 1, SIZE_MAX);
+		queue_out(p, buf, len, SIZE_MAX);
+	}
+	free(buf);
+}
+
+/*
+** Send output to a client. Whatever its pipe does not take right away goes to
+** its queue, which is drained once the pipe becomes writable again. If the
+** queue is full, the overflow policy decides what happens to the client.
+*/
+static int send_client(struct client *p, const void *buf, size_t len) {
+	size_t done = 0;
+
+	/* Keep the ordering: nothing jumps ahead of queued output. */
+	while (!p->outq.len && done < len) {
+		ssize_t n = write(p->fds.fd_mosi, (const uint8_t *)buf + done, len - done);
+
+		if (n > 0) {
+			done += n;
+			continue;
+		} else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN)
+			break;
+		return -1;
+	}
+
+	p->stats.delivered += done;
+	if (done == len)
+		return 0;
+
+	/*
+	** Block: the pty is not read while a queue is full, so a queue never
+	** grows by more than a read past the limit and nothing is lost.
+	*/
+	if (overflow_policy == OVERFLOW_BLOCK) {
+		if (ring_push(&p->outq, (const uint8_t *)buf + done, len - done,
+			      client_queue_max + out_size))
+			return -1;
+		update_full(p);
+		return set_stalled(p, true);
+	}
+
+	if (ring_push(&p->outq, (const uint8_t *)buf + done, len - done, client_queue_max)) {
+		p->stats.dropped += p->outq.len + len - done;
+		stats.dropped += p->outq.len + len - done;
+
+		if (overflow_policy == OVERFLOW_DROP)
+			return -1;
+
+		/* A tap wants the output as it is, and must not have the
+		** program redraw. It just carries on past the gap. */
+		if (p->tap) {
+			ring_clear(&p->outq);
+			return set_stalled(p, false);
+		}
+
+		/*
+		** Sync: stop sending the output, and send screen updates as
+		** fast as the client takes them. What it shows is anyone's
+		** guess now, so the first one is a whole snapshot, after a
+		** cancel for the escape sequence that might have been cut in
+		** half.
+		*/
+		if (overflow_policy == OVERFLOW_SYNC && screen_active) {
+			ring_clear(&p->outq);
+			ring_push(&p->outq, "\30", 1, client_queue_max);
+			screen_view_free(p->view);
+			p->view = nullptr;
+			p->syncing = true;
+			p->stats.syncs++;
+			return set_stalled(p, true);
+		}
+
+		/*
+		** Resync: throw away the backlog, and paint the screen from the
+		** screen model, which cancels and paints over everything by
+		** itself. Without one, cancel any escape sequence that might
+		** have been cut in half and clear the screen, then replay the
+		** scrollback or have the program redraw it.
+		*/
+		static const char resync[] = "\30\33[m\33[H\33[J";
+
+		ring_clear(&p->outq);
+		if (screen_active) {
+			queue_snapshot(p);
+		} else {
+			ring_push(&p->outq, resync, sizeof(resync) - 1,
+				  client_queue_max);
+			if (scrollback_size)
+				queue_scrollback(p);
+			else
+				redraw_pty(redraw_method == REDRAW_SNAPSHOT ?
+					   REDRAW_CTRL_L : redraw_method);
+		}
+	}
+
+	return set_stalled(p, true);
+}
+
+/* Account for a read from the pty. */
+static void count_read(size_t len) {
+	unsigned bucket = 0;
+
+	stats.pty_reads++;
+	stats.pty_bytes += len;
+
+	for (size_t n = len >> 4; n && bucket < 7; n >>= 2)
+		bucket++;
+	stats.read_sizes[bucket]++;
+}
+
+/* Send output to every attached client that is not syncing. */
+static void fanout_copy(const unsigned char *buf, size_t len) {
+	if (screen_active)
+		screen_feed(buf, len);
+	if (scrollback_size)
+		save_scrollback(buf, len);
+	if (shm)
+		publish(buf, len);
+	if (rec)
+		record(REC_OUTPUT, buf, len);
+
+	/* Walk backwards, closing a client moves the last one into its place. */
+	for (unsigned i = nr_clients; i-- > 0 && nr_attached;) {
+		auto &it = *active[i];
+
+		if (!it.attached)
+			continue;
+
+		/* Ring clients only need waking up, if they wait for it. */
+		if (it.ring) {
+			if (!it.rung)
+				ring_doorbell(&it);
+			update_full(&it);
+			continue;
+		}
+
+		if (!it.syncing && send_client(&it, buf, len))
+			drop_client(&it);
+	}
+}
+
+#ifdef HAVE_SPLICE
+/*
+** Zero-copy fan-out. The pty output is spliced into a pipe, and tee()d from
+** there into the pipe of every client that has nothing queued. It only gets
+** copied to userspace (once, however many clients there are) if someone needs
+** the bytes: the screen model, the scrollback, the recording, or a client that
+** did not take all of it.
+*/
+static void fanout_splice(size_t len) {
+	bool need_copy = scrollback_size != 0 || screen_active || rec;
+
+	/* Walk backwards, closing a client moves the last one into its place. */
+	for (unsigned i = nr_clients; i-- > 0;) {
+		auto &it = *active[i];
+
+		it.teed = len;
+		if (!it.attached || it.syncing)
+			continue;
+
+		/* Queued output has to go first, so it gets a copy. */
+		if (it.outq.len) {
+			it.teed = 0;
+			need_copy = true;
+			continue;
+		}
+
+		ssize_t n = tee(zc_pipe[0], it.fds.fd_mosi, len, SPLICE_F_NONBLOCK);
+
+		if (n < 0 && errno != EAGAIN) {
+			drop_client(&it);
+			continue;
+		}
+
+		if (n > 0)
+			it.stats.delivered += n;
+
+		if ((size_t)n < len || n < 0) {
+			it.teed = n > 0 ? n : 0;
+			need_copy = true;
+		}
+	}
+
+	if (!need_copy) {
+		/* Nobody needs the data anymore, just drop it. */
+		ssize_t n = splice(zc_pipe[0], nullptr, zc_null, nullptr, len, SPLICE_F_MOVE);
+
+		if (n < (ssize_t)len)
+			read_all(zc_pipe[0], out_buf, len - (n > 0 ? n : 0));
+		return;
+	}
+
+	/* The pipe holds exactly what we spliced in. */
+	read_all(zc_pipe[0], out_buf, len);
+
+	if (screen_active)
+		screen_feed(out_buf, len);
+	if (scrollback_size)
+		save_scrollback(out_buf, len);
+	if (rec)
+		record(REC_OUTPUT, out_buf, len);
+
+	for (unsigned i = nr_clients; i-- > 0;) {
+		auto &it = *active[i];
+
+		if (it.attached && it.teed < len &&
+		    send_client(&it, out_buf + it.teed, len - it.teed))
+			drop_client(&it);
+	}
+}
+#endif
+
+/* Send out the pty output read so far. */
+static void flush_output(void) {
+	size_t len = out_len;
+
+	if (!len)
+		return;
+
+	out_len = 0;
+	flush_deadline = 0;
+	out_total += len;
+
+#ifdef HAVE_SPLICE
+	if (zc_pipe[0] != -1) {
+		fanout_splice(len);
+		return;
+	}
+#endif
+
+	fanout_copy(out_buf, len);
+}
+
+/* Read from the pty, into zc_pipe with the zero-copy fan-out. */
+static ssize_t read_pty(size_t len) {
+#ifdef HAVE_SPLICE
+	if (zc_pipe[0] != -1) {
+		ssize_t n = splice(the_pty.fd, nullptr, zc_pipe[1], nullptr, len,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (n >= 0 || (errno != EINVAL && errno != ENOSYS) || out_len)
+			return n;
+
+		/* Not supported for this pty, give up on it for good. */
+		close(zc_pipe[0]);
+		close(zc_pipe[1]);
+		zc_pipe[0] = zc_pipe[1] = -1;
+	}
+#endif
+
+	return read(the_pty.fd, out_buf + out_len, len);
+}
+
+/*
+** Size the output buffer to what the program writes: double it when a round
+** of reads filled it, and halve it when one came back with little.
+*/
+static void adapt_out_size(size_t len) {
+	size_t size = out_size;
+	void *buf;
+
+	if (len >= out_size && out_size < out_max)
+		size = out_size * 2 < out_max ? out_size * 2 : out_max;
+	else if (len < out_size / 4 && out_size > BUFSIZE)
+		size = out_size / 2 > BUFSIZE ? out_size / 2 : BUFSIZE;
+
+	if (size == out_size)
+		return;
+
+	/* Keep the old one if it can't be had, it works as well. */
+	buf = realloc(out_buf, size);
+	if (!buf)
+		return;
+
+	out_buf = (unsigned char *)buf;
+	out_size = size;
+}
+
+/*
+** Process activity on the pty - Input and terminal changes are sent out to
+** the attached clients. The pty is read until it runs dry or out_size bytes
+** are in, so a busy program gets larger pieces at a time. With a coalescing
+** window, the output is held back until the window closes or enough of it
+** piled up, unless it is likely the echo of input that was just forwarded.
+** If the pty goes away, we die.
+*/
+static void pty_activity(void) {
+	size_t start = out_len;
+
+	while (out_len < out_size) {
+		ssize_t len = read_pty(out_size - out_len);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0 && errno == EAGAIN) {
+			/* With nothing read, the pipe is full rather than the
+			** pty empty: small reads use up its slots before it
+			** holds out_size bytes. */
+#ifdef HAVE_SPLICE
+			if (out_len == start && zc_pipe[0] != -1)
+				flush_output();
+#endif
+			break;
+		}
+
+		/* Error -> die, after sending out what we have. */
+		if (len <= 0) {
+			flush_output();
+			exit(1);
+		}
+
+		count_read(len);
+		out_len += len;
+	}
+
+	if (!coalesce_us) {
+		size_t len = out_len - start;
+
+		flush_output();
+		adapt_out_size(len);
+	} else if (out_len >= out_size || input_forwarded) {
+		input_forwarded = false;
+		flush_output();
+	} else if (!flush_deadline) {
+		flush_deadline = now_us() + coalesce_us;
+	}
+}
+
+/*
+** Read what a detached session's program wrote since the last time, with the
+** batch policy. Stop when the pty has nothing more, or after a bounded number
+** of reads so that a program that does not stop writing is held back too.
+*/
+static void read_batch(void) {
+	struct pollfd pfd = { the_pty.fd, POLLIN, 0 };
+
+	batch_deadline = now_us() + (uint64_t)batch_interval * 1000;
+	for (int i = 0; i < BATCH_READS && poll(&pfd, 1, 0) > 0; i++)
+		pty_activity();
+
+	if (out_len)
+		flush_output();
+}
+
+/* When the client holding up the pty the longest is due to be dropped. */
+static uint64_t full_deadline(void) {
+	uint64_t since = UINT64_MAX;
+
+	for (unsigned i = 0; i < nr_clients; i++) {
+		auto &it = *active[i];
+
+		if (it.full && it.full_since < since)
+			since = it.full_since;
+	}
+
+	return since + (uint64_t)block_timeout * 1000;
+}
+
+/* Drop the clients that held up the pty for too long. */
+static void close_full_clients(void) {
+	uint64_t now = now_us();
+
+	for (unsigned i = 0; i < nr_clients; ) {
+		auto &it = *active[i];
+
+		if (it.full && now >= it.full_since + (uint64_t)block_timeout * 1000) {
+			/* The last one takes its place in active[]. */
+			drop_client(&it);
+			continue;
+		}
+		i++;
+	}
+}
+
+/* Format the counters of the session and of every client. */
+static char *format_stats(size_t *len) {
+	size_t size = 512 + nr_clients * 360, off;
+	uint64_t now = now_us();
+	char *buf = (char *)malloc(size);
+
+	if (!buf)
+		return nullptr;
+
+	off = snprintf(buf, size,
+		"session pid=%d clients=%u attached=%u taps=%u wakeups=%" PRIu64
+		" pty_reads=%" PRIu64 " pty_bytes=%" PRIu64
+		" reads_lt16=%" PRIu64 " reads_lt64=%" PRIu64
+		" reads_lt256=%" PRIu64 " reads_lt1k=%" PRIu64
+		" reads_lt4k=%" PRIu64 " reads_lt16k=%" PRIu64
+		" reads_lt64k=%" PRIu64 " reads_ge64k=%" PRIu64
+		" stall_ms=%" PRIu64 " dropped=%" PRIu64 " paused_ms=%" PRIu64
+		" input_queued=%zu resizes=%" PRIu64 " ring_head=%" PRIu64
+		" rec_head=%" PRIu64 "\n",
+		(int)getpid(), nr_clients, nr_attached, nr_taps, stats.wakeups,
+		stats.pty_reads, stats.pty_bytes,
+		stats.read_sizes[0], stats.read_sizes[1], stats.read_sizes[2],
+		stats.read_sizes[3], stats.read_sizes[4], stats.read_sizes[5],
+		stats.read_sizes[6], stats.read_sizes[7],
+		(stats.stall_us + (nr_stalled ? now - stall_since : 0)) / 1000,
+		stats.dropped,
+		(stats.paused_us + (pty_paused ? now - paused_since : 0)) / 1000,
+		inq.len, stats.resizes, shm ? shm->head : 0, rec ? rec->head : 0);
+
+	for (unsigned i = 0; i < nr_clients && off < size; i++) {
+		auto &it = *active[i];
+
+		off += snprintf(buf + off, size - off,
+			"client index=%d pid=%d attached=%d proto=%u ring=%d tap=%d"
+			" delivered=%" PRIu64
+			" dropped=%" PRIu64 " queued=%zu stall_ms=%" PRIu64
+			" syncs=%u msg_push=%u msg_attach=%u msg_detach=%u msg_winch=%u"
+			" msg_redraw=%u msg_ring=%u msg_tap=%u msg_other=%u\n",
+			it.index, (int)it.pid, it.attached, it.proto, it.ring, it.tap,
+			it.stats.delivered,
+			it.stats.dropped, it.outq.len,
+			(it.stats.stall_us + (it.stalled ? now - it.stall_since : 0)) / 1000,
+			it.stats.syncs, it.stats.msgs[MSG_PUSH], it.stats.msgs[MSG_ATTACH],
+			it.stats.msgs[MSG_DETACH], it.stats.msgs[MSG_WINCH],
+			it.stats.msgs[MSG_REDRAW], it.stats.msgs[MSG_RING],
+			it.stats.msgs[MSG_TAP], it.stats.msgs[MSG_OTHER]);
+	}
+
+	*len = off < size ? off : size - 1;
+	return buf;
+}
+
+/*
+** Send a reply to the pipe the requester created for it, in the runtime
+** directory or next to the socket. Don't let a requester that stopped reading
+** hold up the session for long.
+*/
+static int send_reply(pid_t pid, const void *buf, size_t len) {
+	int fd = -1;
+	size_t done = 0;
+
+	if (pool_dir)
+		fd = open(str_fmt("%s/r%d", pool_dir, (int)pid), O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+		fd = open(str_fmt("%s_r%d", sockname, (int)pid), O_WRONLY | O_NONBLOCK);
+
+	/* Gone already. */
+	if (fd < 0)
+		return -1;
+
+	while (done < len) {
+		ssize_t n = write(fd, (const uint8_t *)buf + done, len - done);
+
+		if (n > 0) {
+			done += n;
+			continue;
+		} else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+
+			if (poll(&pfd, 1, REPLY_TIMEOUT) > 0)
+				continue;
+		}
+		break;
+	}
+
+	close(fd);
+	return done == len ? 0 : -1;
+}
+
+/*
+** Create the pipes of a slot that is not in the pool. Unlike
+** create_conn_pipes(), running out of descriptors only turns the client away.
+*/
+static int create_slot_pipes(unsigned idx, conn_pipes *fds) {
+	const char *miso = str_fmt("%s_%u_miso", sockname, idx);
+	const char *mosi = str_fmt("%s_%u_mosi", sockname, idx);
+
+	ensure_mkfifo(miso);
+	ensure_mkfifo(mosi);
+	fds->fd_miso = open(miso, O_RDWR | O_NONBLOCK);
+	fds->fd_mosi = open(mosi, O_RDWR | O_NONBLOCK);
+	if (fds->fd_miso >= 0 && fds->fd_mosi >= 0)
+		return 0;
+
+	if (fds->fd_miso >= 0)
+		close(fds->fd_miso);
+	if (fds->fd_mosi >= 0)
+		close(fds->fd_mosi);
+	fds->fd_miso = fds->fd_mosi = -1;
+	return -1;
+}
+
+/*
+** Give a new client the lowest free slot below limit, speaking the protocol
+** version given, and watch for its process to exit if it told us which one it
+** is. Returns the slot, or -1 if there is none we can set up.
+*/
+static int create_client(uint8_t proto, unsigned limit, pid_t pid) {
+	int slot = alloc_slot(limit);
+
+	if (slot < 0)
+		return -1;
+
+	auto &cl = *clients[slot];
+	bool ok = true;
+
+	cl.proto = proto;
+	cl.rxbuf = (unsigned char *)malloc(RXBUF_SIZE);
+	if (!cl.rxbuf) {
+		THROW_ERROR("failed to allocate client buffer");
+	}
+
+	if ((unsigned)slot < pool_size)
+		cl.fds = pool[slot];
+	else
+		ok = create_slot_pipes(slot, &cl.fds) == 0;
+
+	/* select() can't watch descriptors past FD_SETSIZE either. */
+	if (!ok || ev_add(cl.fds.fd_miso, EV_READ, &cl) ||
+	    ev_add(cl.fds.fd_mosi, 0, &cl)) {
+		close_client(&cl);
+		return -1;
+	}
+
+	watch_pid(&cl, pid);
+	return slot;
+}
+
+/* Process an extended control request. */
+static void control_request(const struct ctrl_req *req) {
+	if (req->op == CTRL_STATS) {
+		size_t len;
+		char *buf = format_stats(&len);
+
+		if (buf) {
+			send_reply(req->pid, buf, len);
+			free(buf);
+		}
+	} else if (req->op == CTRL_CREATE) {
+		uint8_t proto = (req->arg & 0xff) >= PROTO_V2 ? PROTO_V2 : PROTO_V1;
+		bool wide = (req->arg & CREATE_WIDE) != 0;
+		unsigned limit = wide ? MAX_CLIENTS_WIDE : MAX_CLIENTS;
+		int slot = create_client(proto, limit, req->pid);
+		uint32_t new_index = slot < 0 ? limit : slot;
+		int ret;
+
+		/* Let the client know that we speak frames. */
+		if (wide) {
+			if (proto >= PROTO_V2)
+				new_index |= 1U << 31;
+			ret = send_reply(req->pid, &new_index, sizeof(new_index));
+		} else {
+			uint8_t byte = new_index | (proto >= PROTO_V2 ? 1 << 7 : 0);
+
+			ret = send_reply(req->pid, &byte, 1);
+		}
+
+		/* Nobody to hand the slot to, that we know of. */
+		if (ret && slot >= 0)
+			drop_client(clients[slot]);
+	} else if (req->op == CTRL_DISCONNECT) {
+		if (req->arg < clients_size && clients[req->arg])
+			close_client(clients[req->arg]);
+	}
+}
+
+/*
+** Process a control byte of the original handshake: a create request, with
+** the reply going to the shared pipe, or a disconnect.
+*/
+static void control_byte(const conn_pipes &fd_main_pipe, uint8_t ctrl_byte) {
+	bool is_create = (ctrl_byte & (1 << 7)) != 0;
+	uint8_t req_index = ctrl_byte & 0x7f;
+
+	if (is_create) {
+		/* Older clients don't ask for a version. */
+		uint8_t proto = req_index >= PROTO_V2 ? PROTO_V2 : PROTO_V1;
+		int slot = create_client(proto, MAX_CLIENTS, 0);
+		uint8_t new_index = slot < 0 ? MAX_CLIENTS : slot;
+
+		/* Let the client know that we speak frames. */
+		if (proto >= PROTO_V2)
+			new_index |= 1 << 7;
+
+		if (write(fd_main_pipe.fd_mosi, &new_index, 1) != 1) {
+			THROW_ERROR("failed to write main pipe");
+		}
+	} else if (req_index < clients_size && clients[req_index]) {
+		close_client(clients[req_index]);
+	}
+}
+
+/*
+** Process extended control requests. Each one is written in one go, and less
+** than PIPE_BUF, so they are read a whole batch at a time and never cut off.
+*/
+static void control_requests(void) {
+	struct ctrl_req reqs[CTRL_BATCH / sizeof(struct ctrl_req)];
+	ssize_t len = read(ctl_fd, reqs, sizeof(reqs));
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		THROW_ERROR("failed to read control pipe");
+	}
+
+	for (size_t i = 0; i < len / sizeof(struct ctrl_req); i++)
+		control_request(&reqs[i]);
+}
+
+/*
+** Process activity on the control socket. Requests are a byte each, so a
+** whole batch of them is read at once.
+*/
+static void control_activity(const conn_pipes &fd_main_pipe) {
+	uint8_t buf[CTRL_BATCH];
+	ssize_t len = read(fd_main_pipe.fd_miso, buf, sizeof(buf));
+
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		THROW_ERROR("failed to read main pipe");
+	}
+
+	for (ssize_t i = 0; i < len; i++)
+		control_byte(fd_main_pipe, buf[i]);
+}
+
+/* Handle a message from a client. */
+static int client_message(struct client *p, int type, int arg,
+			  const unsigned char *data, size_t len) {
+	p->stats.msgs[type < MSG_OTHER ? type : MSG_OTHER]++;
+
+	/* Push out data to the program. */
+	if (type == MSG_PUSH) {
+		if (len) {
+			write_pty(data, len);
+			input_forwarded = true;
+			if (rec)
+				record(REC_INPUT, data, len);
+
+			/* Typing makes the client the one whose size counts. */
+			p->active_at = now_us();
+			if (winsize_policy == WINSIZE_RECENT && p->has_ws &&
+			    !resize_deadline &&
+			    memcmp(&p->ws, &the_pty.ws, sizeof(p->ws)) != 0)
+				schedule_resize();
+
+			/* Leave the rest of its messages in the pipe until
+			** the program catches up. */
+			if (inq.len >= INPUT_QUEUE_MAX)
+				set_held(p, true);
+		}
+	}
+
+		/* Attach or detach from the program. */
+	else if (type == MSG_ATTACH) {
+		if (!p->attached)
+			p->ring = arg == ATTACH_RING && shm && p->proto >= PROTO_V2;
+
+		/* Before anything else, so it knows how to read what follows. */
+		if (!p->attached && arg == ATTACH_RING && p->proto >= PROTO_V2)
+			queue_ring_answer(p);
+
+		/* Bring the client up to date before any live output. */
+		if (!p->attached && screen_active) {
+			queue_snapshot(p);
+			p->replayed = true;
+		} else if (!p->attached && scrollback_size) {
+			queue_scrollback(p);
+			p->replayed = true;
+		}
+
+		/* Live output comes from the ring from here on. */
+		if (!p->attached && p->ring)
+			queue_ring_start(p);
+
+		if (!p->attached && p->outq.len && flush_client(p))
+			return -1;
+		set_attached(p, true);
+	} else if (type == MSG_DETACH)
+		set_attached(p, false);
+
+		/* Get the output without attaching: nothing is replayed or
+		** redrawn, and there is no window size to go by. The client
+		** hears first that we understood. */
+	else if (type == MSG_TAP) {
+		if (!p->attached) {
+			struct frame hdr;
+
+			hdr.type = MSG_TAP;
+			hdr.arg = 0;
+			hdr.len = 0;
+			ring_push(&p->outq, &hdr, sizeof(hdr), SIZE_MAX);
+			if (flush_client(p))
+				return -1;
+
+			p->tap = true;
+			nr_taps++;
+			set_attached(p, true);
+		}
+	}
+
+		/* Window size change request, without a forced redraw. */
+	else if (type == MSG_WINCH)
+	{
+		if (len != sizeof(struct winsize))
+			return 0;
+
+		memcpy(&p->ws, data, len);
+		p->has_ws = true;
+		p->active_at = now_us();
+		schedule_resize();
+	}
+
+		/* Force a redraw using a particular method. */
+	else if (type == MSG_REDRAW)
+	{
+		int method = arg;
+		bool replayed = p->replayed;
+		bool resized;
+
+		p->replayed = false;
+
+		/* If the client didn't specify a particular method, use
+		** whatever we had on startup. */
+		if (method == REDRAW_UNSPEC)
+			method = redraw_method;
+		if (method == REDRAW_NONE || len != sizeof(struct winsize))
+			return 0;
+
+		/* Set the window size right away, the client is waiting to
+		** be painted. */
+		memcpy(&p->ws, data, len);
+		p->has_ws = true;
+		p->active_at = now_us();
+		resized = apply_resize();
+
+		/* The scrollback already brought the client up to date. */
+		if (replayed)
+			return 0;
+
+		/* Paint the screen ourselves, if we keep track of it. */
+		if (method == REDRAW_SNAPSHOT) {
+			if (!screen_active) {
+				redraw_pty(REDRAW_CTRL_L);
+				return 0;
+			}
+			queue_snapshot(p);
+			if (p->ring)
+				queue_ring_start(p);
+			return flush_client(p);
+		}
+
+		/* Unless the new size already had the program redraw. */
+		if (method != REDRAW_WINCH || !resized)
+			redraw_pty(method);
+	}
+
+		/* A ring client caught up to the sequence number given. */
+	else if (type == MSG_RING)
+	{
+		uint64_t seq;
+
+		if (!p->ring || len != sizeof(seq))
+			return 0;
+
+		memcpy(&seq, data, len);
+		if (seq - p->acked <= shm->head - p->acked)
+			p->acked = seq;
+		if (seq != shm->head)
+			ring_doorbell(p);
+		else
+			p->rung = false;
+		update_full(p);
+	}
+
+	return 0;
+}
+
+/*
+** Handle the messages in the first len bytes of the buffer. Returns the
+** number of bytes used, the rest is an incomplete message. Returns -1 if the
+** client has to be closed.
+*/
+static ssize_t client_messages(struct client *p, const unsigned char *buf, size_t len) {
+	size_t off = 0;
+
+	/* The original protocol, fixed size packets. */
+	if (p->proto < PROTO_V2) {
+		struct packet pkt;
+
+		for (; len - off >= sizeof(pkt); off += sizeof(pkt)) {
+			int ret;
+
+			memcpy(&pkt, buf + off, sizeof(pkt));
+			if (pkt.type == MSG_PUSH) {
+				if (pkt.len > sizeof(pkt.u.buf))
+					continue;
+				ret = client_message(p, pkt.type, 0, pkt.u.buf, pkt.len);
+			} else {
+				ret = client_message(p, pkt.type, pkt.len, pkt.u.buf, sizeof(pkt.u.ws));
+			}
+
+			if (ret)
+				return -1;
+		}
+
+		return off;
+	}
+
+	/* Frames. */
+	while (len - off >= sizeof(struct frame)) {
+		struct frame hdr;
+
+		memcpy(&hdr, buf + off, sizeof(hdr));
+		if (hdr.len > FRAME_MAX)
+			return -1;
+		if (len - off - sizeof(hdr) < hdr.len)
+			break;
+
+		if (client_message(p, hdr.type, hdr.arg, buf + off + sizeof(hdr), hdr.len))
+			return -1;
+
+		off += sizeof(hdr) + hdr.len;
+	}
+
+	return off;
+}
+
+/*
+** Process activity from a client. Read as much as the buffer takes and handle
+** every complete message in it, so a backed up client costs one wakeup per
+** buffer instead of one per message.
+*/
+static int client_activity(struct client *p) {
+	ssize_t len;
+
+	/* Read the activity, after whatever is left over from last time. */
+	len = read(p->fds.fd_miso, p->rxbuf + p->rxlen, RXBUF_SIZE - p->rxlen);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	/* Close the client on an error. */
+	if (len <= 0)
+		return -1;
+
+	p->rxlen += len;
+
+	len = client_messages(p, p->rxbuf, p->rxlen);
+	if (len < 0)
+		return -1;
+
+	/* Keep the partial message for the next read. */
+	p->rxlen -= len;
+	memmove(p->rxbuf, p->rxbuf + len, p->rxlen);
+	return 0;
+}
+
+/* The master process - It watches over the pty process and the attached */
+/* clients. */
+static void master_process(const conn_pipes &fd_main_pipe, char **argv, int waitattach, int statusfd) {
+	struct ev_event evs[EV_MAX_EVENTS];
+	int nullfd;
 
 	int has_attached_client = 0;
 
@@ -498,10 +2353,74 @@ static void master_process(const conn_pipes &fd_main_pipe, char **argv, int wait
 	signal(SIGINT, die);
 	signal(SIGTERM, die);
 
+	/* Each client takes two or three descriptors. The program was started
+	** already, so it keeps the limit it had. */
+	raise_fd_limit();
+
 	/* Close statusfd, since we don't need it anymore. */
 	if (statusfd != -1)
 		close(statusfd);
 
+	/* The pty is read until it runs dry. */
+	fcntl(the_pty.fd, F_SETFL, fcntl(the_pty.fd, F_GETFL) | O_NONBLOCK);
+
+	/* Keep track of the screen, if that is how we redraw or bring slow
+	** clients up to date. */
+	if (redraw_method == REDRAW_SNAPSHOT || overflow_policy == OVERFLOW_SYNC)
+		screen_init(the_pty.ws.ws_row, the_pty.ws.ws_col);
+
+	/* The recording starts out with the size the program got. */
+	if (rec) {
+		rec->rows = the_pty.ws.ws_row;
+		rec->cols = the_pty.ws.ws_col;
+	}
+
+	/* Without a coalescing window, the output goes out as it is read, in
+	** pieces that start small. */
+	out_max = coalesce_us ? coalesce_bytes : read_max;
+	out_size = coalesce_us ? coalesce_bytes : BUFSIZE;
+
+	/* With the block policy, a ring client that is not full yet has room
+	** for a whole read in the ring. */
+	if (shm && overflow_policy == OVERFLOW_BLOCK && out_max > shm->size / 2)
+		out_max = shm->size / 2;
+	if (out_size > out_max)
+		out_size = out_max;
+
+#ifdef HAVE_SPLICE
+	/* Set up the zero-copy fan-out, if asked for. The shared ring needs
+	** the bytes anyway. */
+	if (fanout_method == FANOUT_SPLICE && !shm) {
+		zc_null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (zc_null < 0 || pipe2(zc_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			zc_pipe[0] = zc_pipe[1] = -1;
+		}
+	}
+
+	/*
+	** The output read in one go has to fit in the pipe. Every splice takes
+	** up a page of it however little it moves, so ask for more room than
+	** that, to hold a good number of small reads.
+	*/
+	if (zc_pipe[0] != -1 && out_max > BUFSIZE) {
+		int size = fcntl(zc_pipe[1], F_SETPIPE_SZ, (int)(out_max * 4));
+
+		if (size < 0)
+			size = fcntl(zc_pipe[1], F_SETPIPE_SZ, (int)out_max);
+		if (size < 0)
+			size = fcntl(zc_pipe[1], F_GETPIPE_SZ);
+		if (size >= BUFSIZE && (size_t)size < out_max)
+			out_max = size;
+		if (out_size > out_max)
+			out_size = out_max;
+	}
+#endif
+
+	out_buf = (unsigned char *)malloc(out_size);
+	if (!out_buf) {
+		THROW_ERROR("out of memory");
+	}
+
 	/* Make sure stdin/stdout/stderr point to /dev/null. We are now a
 	** daemon. */
 	nullfd = open("/dev/null", O_RDWR);
@@ -511,83 +2430,139 @@ static void master_process(const conn_pipes &fd_main_pipe, char **argv, int wait
 	if (nullfd > 2)
 		close(nullfd);
 
+	/*
+	** Register the control socket and the pty with the event engine. When
+	** waitattach is set, wait until the client attaches before trying to
+	** read from the pty.
+	*/
+	ev_init(event_engine);
+	if (ev_add(fd_main_pipe.fd_miso, EV_READ, (void *)&fd_main_pipe) ||
+	    ev_add(ctl_fd, EV_READ, &ctl_fd)) {
+		THROW_ERROR("failed to set up event engine");
+	}
+	watch_child();
+	if (!waitattach)
+		watch_pty();
+	else
+		update_pty();
+
 	/* Loop forever. */
 	while (1) {
-		int new_has_attached_client = 0;
-
-		/* Re-initialize the file descriptor set for select. */
-		FD_ZERO(&readfds);
-		FD_SET(fd_main_pipe.fd_miso, &readfds);
-		highest_fd = fd_main_pipe.fd_miso;
+		uint64_t deadline;
+		int n, timeout;
 
-		/*
-		** When waitattach is set, wait until the client attaches
-		** before trying to read from the pty.
-		*/
-		if (waitattach) {
-			if (clients[0].index != -1 && clients[0].attached)
-				waitattach = 0;
-		} else {
-			FD_SET(the_pty.fd, &readfds);
-			if (the_pty.fd > highest_fd)
-				highest_fd = the_pty.fd;
+		/* chmod the socket if necessary. */
+		if (has_attached_client != (nr_attached > nr_taps)) {
+			has_attached_client = nr_attached > nr_taps;
+			update_socket_modes(has_attached_client);
 		}
 
-		cnt = 0;
-		for (auto &it : clients) {
-			if (it.index != -1) {
-				FD_SET(it.fds.fd_miso, &readfds);
-				if (it.fds.fd_miso > highest_fd)
-					highest_fd = it.fds.fd_miso;
-
-				if (it.attached)
-					new_has_attached_client = 1;
-
-				cnt++;
-			}
-
-			if (cnt >= nr_clients) {
-				break;
-			}
+		/* Wait for something to happen, or for the coalesced output,
+		** a client holding up the pty, a batch read, the sweep, a
+		** resize or the writeback of the recording to be due. */
+		deadline = flush_deadline;
+		if (batch_deadline && pty_watched &&
+		    (!deadline || batch_deadline < deadline))
+			deadline = batch_deadline;
+		if (nr_swept && (!deadline || sweep_deadline < deadline))
+			deadline = sweep_deadline;
+		if (resize_deadline && (!deadline || resize_deadline < deadline))
+			deadline = resize_deadline;
+		if (rec_deadline && (!deadline || rec_deadline < deadline))
+			deadline = rec_deadline;
+		if (nr_full) {
+			uint64_t due = full_deadline();
+
+			if (!deadline || due < deadline)
+				deadline = due;
 		}
 
-		/* chmod the socket if necessary. */
-		if (has_attached_client != new_has_attached_client) {
-			update_socket_modes(new_has_attached_client);
-			has_attached_client = new_has_attached_client;
+		timeout = -1;
+		if (deadline) {
+			uint64_t now = now_us();
+
+			timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
 		}
 
-		/* Wait for something to happen. */
-		if (select(highest_fd + 1, &readfds, nullptr, nullptr, nullptr) < 0) {
+		n = ev_wait(evs, EV_MAX_EVENTS, timeout);
+		if (n < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
 			THROW_ERROR("select");
 			exit(1);
 		}
+		stats.wakeups++;
+
+		for (int i = 0; i < n; i++) {
+			void *data = evs[i].data;
+
+			if (data == &fd_main_pipe) {
+				/* New client? */
+				control_activity(fd_main_pipe);
+			} else if (data == &ctl_fd) {
+				/* A request on the extended control pipe? */
+				control_requests();
+			} else if (data == &child_fd) {
+				/* Did the program exit? */
+				child_activity();
+			} else if (data == &the_pty) {
+				/* pty activity? */
+				if (evs[i].events & EV_WRITE)
+					flush_input();
+				if (evs[i].events & EV_READ)
+					pty_activity();
+			} else if (auto owner = pidfd_owner(data)) {
+				/* A client's process exited. */
+				if (owner->index != -1 && owner->pidfd >= 0)
+					client_gone(owner);
+			} else {
+				/* Activity on a client? */
+				auto p = (struct client *)data;
 
-		/* New client? */
-		if (FD_ISSET(fd_main_pipe.fd_miso, &readfds))
-			control_activity(fd_main_pipe);
-		/* Activity on a client? */
-		cnt = 0;
-		for (auto &it : clients) {
-			if (it.index != -1) {
-				cnt++;
+				/* It may have been closed by an earlier event. */
+				if (p->index == -1)
+					continue;
 
-				if (FD_ISSET(it.fds.fd_miso, &readfds)) {
-					if (client_activity(&it)) {
-						it.index = -1;
-					}
+				if ((evs[i].events & EV_READ) && client_activity(p)) {
+					drop_client(p);
+					continue;
+				}
+				if ((evs[i].events & EV_READ) && p->gone && drained(p)) {
+					close_client(p);
+					continue;
 				}
-			}
 
-			if (cnt >= nr_clients) {
-				break;
+				/* Its pipe has room for queued output. */
+				if ((evs[i].events & EV_WRITE) && flush_client(p))
+					drop_client(p);
 			}
 		}
-		/* pty activity? */
-		if (FD_ISSET(the_pty.fd, &readfds))
-			pty_activity(fd_main_pipe);
+
+		if (flush_deadline && now_us() >= flush_deadline)
+			flush_output();
+
+		if (nr_full && now_us() >= full_deadline())
+			close_full_clients();
+
+		if (nr_swept && now_us() >= sweep_deadline)
+			sweep_pids();
+
+		if (resize_deadline && now_us() >= resize_deadline)
+			apply_resize();
+
+		if (rec_deadline && now_us() >= rec_deadline)
+			flush_recording();
+
+		free_closed_clients();
+
+		if (batch_deadline && pty_watched && now_us() >= batch_deadline)
+			read_batch();
+
+		/* The first client attached, start reading the pty. */
+		if (waitattach && clients_size && clients[0] && clients[0]->attached) {
+			waitattach = 0;
+			watch_pty();
+		}
 	}
 }
 
@@ -602,6 +2577,10 @@ int master_main(char **argv, int waitattach, int dontfork) {
 
 	/* Create the unix domain socket. */
 	fd_main_pipe = create_conn_pipes(sockname, false);
+	create_ctl_pipe();
+	create_pool();
+	create_shm_ring();
+	create_recording();
 
 #if defined(F_SETFD) && defined(FD_CLOEXEC)
 	fcntl(fd_main_pipe.fd_miso, F_SETFD, FD_CLOEXEC);
@@ -666,6 +2645,8 @@ int master_main(char **argv, int waitattach, int dontfork) {
 #endif
 	close(fd_main_pipe.fd_miso);
 	close(fd_main_pipe.fd_mosi);
+	close(ctl_fd);
+	close_pool();
 	return 0;
 }
 
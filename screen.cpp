@@ -0,0 +1,1293 @@
+/*
+    This file is part of dtachez.
+
+    Copyright (C) 2023 SudoMaker, Ltd.
+    Author: Reimu NotMoe <reimu@sudomaker.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "dtachez.hpp"
+
+#include <cstdarg>
+
+/*
+** The screen model. The master feeds it everything the program writes to the
+** pty, and it keeps track of what a VT100/xterm would display: the characters
+** and their attributes, the cursor, the scroll region, the alternate screen and
+** the modes that change how the terminal behaves. When a client attaches, the
+** model is turned back into a stream of escape sequences that paints the same
+** screen on the client's terminal, without any help from the program.
+**
+** This runs on every byte of output, so it is kept simple: a cell is 8 bytes,
+** the cells of a screen are one block of memory, and scrolling only rotates
+** the row pointers.
+*/
+
+/* Attributes of a cell. */
+enum {
+	ATTR_BOLD	= 1 << 0,
+	ATTR_DIM	= 1 << 1,
+	ATTR_ITALIC	= 1 << 2,
+	ATTR_UNDERLINE	= 1 << 3,
+	ATTR_BLINK	= 1 << 4,
+	ATTR_REVERSE	= 1 << 5,
+	ATTR_HIDDEN	= 1 << 6,
+	ATTR_STRIKE	= 1 << 7,
+};
+
+/* Flags of a cell. */
+enum {
+	CELL_FG		= 1 << 0,	/* fg is set, instead of the default */
+	CELL_BG		= 1 << 1,	/* bg is set, instead of the default */
+	CELL_ACS	= 1 << 2,	/* ch is from the DEC line drawing set */
+};
+
+struct cell {
+	/* The code point, 0 for the right half of a wide character. */
+	uint32_t ch;
+	uint8_t attr;
+	uint8_t flags;
+	uint8_t fg, bg;
+};
+
+/* Modes, and the private mode numbers they are set with. */
+enum {
+	MODE_WRAP	= 1 << 0,
+	MODE_ORIGIN	= 1 << 1,
+	MODE_INSERT	= 1 << 2,
+	MODE_SHOWCURSOR	= 1 << 3,
+	MODE_APPCURSOR	= 1 << 4,
+	MODE_APPKEYPAD	= 1 << 5,
+	MODE_BRACKETED	= 1 << 6,
+	MODE_MOUSE_X10	= 1 << 7,
+	MODE_MOUSE	= 1 << 8,
+	MODE_MOUSE_BTN	= 1 << 9,
+	MODE_MOUSE_ANY	= 1 << 10,
+	MODE_FOCUS	= 1 << 11,
+	MODE_MOUSE_UTF8	= 1 << 12,
+	MODE_MOUSE_SGR	= 1 << 13,
+	MODE_MOUSE_URXVT = 1 << 14,
+};
+
+#define MODE_DEFAULT (MODE_WRAP | MODE_SHOWCURSOR)
+
+static const struct {
+	uint16_t num;
+	uint16_t mode;
+} private_modes[] = {
+	{ 1, MODE_APPCURSOR },
+	{ 6, MODE_ORIGIN },
+	{ 7, MODE_WRAP },
+	{ 9, MODE_MOUSE_X10 },
+	{ 25, MODE_SHOWCURSOR },
+	{ 1000, MODE_MOUSE },
+	{ 1002, MODE_MOUSE_BTN },
+	{ 1003, MODE_MOUSE_ANY },
+	{ 1004, MODE_FOCUS },
+	{ 1005, MODE_MOUSE_UTF8 },
+	{ 1006, MODE_MOUSE_SGR },
+	{ 1015, MODE_MOUSE_URXVT },
+	{ 2004, MODE_BRACKETED },
+};
+
+/* Character sets. */
+enum {
+	CHARSET_ASCII	= 0,
+	CHARSET_ACS	= 1,
+};
+
+/* Parser states. */
+enum {
+	STATE_GROUND,
+	STATE_ESC,
+	STATE_ESC_INTER,
+	STATE_CSI,
+	STATE_STRING,
+	STATE_STRING_ESC,
+};
+
+#define CSI_MAX_PARAMS	16
+
+/* What DECSC saves. */
+struct cursor {
+	int x, y;
+	struct cell pen;
+	uint32_t origin;
+	uint8_t charsets[2], shift;
+};
+
+static struct {
+	int rows, cols;
+	/* The cells of the main and the alternate screen, and the rows of the
+	** one that is showing. */
+	struct cell *cells[2];
+	struct cell **line[2];
+	int alt;
+	/* Room for the rows moved out of the way while scrolling. */
+	struct cell **spare;
+
+	int x, y;
+	/* The cursor is past the last column, and the next character wraps. */
+	bool wrapnext;
+	struct cell pen;
+	int top, bot;
+	uint32_t modes;
+	uint8_t charsets[2], shift;
+	struct cursor saved;
+
+	/* The parser. */
+	int state;
+	unsigned char inter, priv;
+	int params[CSI_MAX_PARAMS], nparams;
+	uint32_t utf8_cp;
+	int utf8_need;
+} scr;
+
+/* Whether the screen model is running. */
+bool screen_active;
+
+/* The display width of a code point: 0 for combining marks, 2 for the wide
+** East Asian characters and emoji, 1 for everything else. */
+static int char_width(uint32_t c) {
+	if (c < 0x300)
+		return 1;
+	if ((c >= 0x300 && c <= 0x36f) || (c >= 0x1ab0 && c <= 0x1aff) ||
+	    (c >= 0x1dc0 && c <= 0x1dff) || (c >= 0x200b && c <= 0x200f) ||
+	    (c >= 0x20d0 && c <= 0x20ff) || (c >= 0xfe00 && c <= 0xfe0f) ||
+	    (c >= 0xfe20 && c <= 0xfe2f))
+		return 0;
+	if ((c >= 0x1100 && c <= 0x115f) || (c >= 0x2e80 && c <= 0x303e) ||
+	    (c >= 0x3041 && c <= 0x33ff) || (c >= 0x3400 && c <= 0x4dbf) ||
+	    (c >= 0x4e00 && c <= 0x9fff) || (c >= 0xa000 && c <= 0xa4cf) ||
+	    (c >= 0xac00 && c <= 0xd7a3) || (c >= 0xf900 && c <= 0xfaff) ||
+	    (c >= 0xfe30 && c <= 0xfe4f) || (c >= 0xff00 && c <= 0xff60) ||
+	    (c >= 0xffe0 && c <= 0xffe6) || (c >= 0x1f300 && c <= 0x1f64f) ||
+	    (c >= 0x1f900 && c <= 0x1f9ff) || (c >= 0x20000 && c <= 0x3fffd))
+		return 2;
+	return 1;
+}
+
+/* A blank cell, as erased with the current pen. */
+static inline struct cell blank(void) {
+	struct cell c;
+
+	c.ch = ' ';
+	c.attr = 0;
+	c.flags = scr.pen.flags & CELL_BG;
+	c.fg = 0;
+	c.bg = scr.pen.bg;
+	return c;
+}
+
+static void clear_cells(struct cell *p, int n) {
+	struct cell b = blank();
+
+	for (int i = 0; i < n; i++)
+		p[i] = b;
+}
+
+static void clear_lines(int from, int to) {
+	for (int y = from; y <= to; y++)
+		clear_cells(scr.line[scr.alt][y], scr.cols);
+}
+
+/* Scroll the lines from top to bot up by n, the rows wrap around. */
+static void scroll_up(int top, int bot, int n) {
+	struct cell **l = scr.line[scr.alt];
+
+	if (n > bot - top + 1)
+		n = bot - top + 1;
+
+	struct cell **tmp = scr.spare;
+
+	memcpy(tmp, l + top, n * sizeof(*l));
+	memmove(l + top, l + top + n, (bot - top + 1 - n) * sizeof(*l));
+	memcpy(l + bot + 1 - n, tmp, n * sizeof(*l));
+	clear_lines(bot + 1 - n, bot);
+}
+
+static void scroll_down(int top, int bot, int n) {
+	struct cell **l = scr.line[scr.alt];
+
+	if (n > bot - top + 1)
+		n = bot - top + 1;
+
+	struct cell **tmp = scr.spare;
+
+	memcpy(tmp, l + bot + 1 - n, n * sizeof(*l));
+	memmove(l + top + n, l + top, (bot - top + 1 - n) * sizeof(*l));
+	memcpy(l + top, tmp, n * sizeof(*l));
+	clear_lines(top, top + n - 1);
+}
+
+static void move_to(int x, int y) {
+	int top = 0, bot = scr.rows - 1;
+
+	if (scr.modes & MODE_ORIGIN) {
+		top = scr.top;
+		bot = scr.bot;
+	}
+
+	scr.x = x < 0 ? 0 : x >= scr.cols ? scr.cols - 1 : x;
+	scr.y = y < top ? top : y > bot ? bot : y;
+	scr.wrapnext = false;
+}
+
+/* Move to a position given relative to the origin. */
+static void move_to_origin(int x, int y) {
+	move_to(x, (scr.modes & MODE_ORIGIN) ? y + scr.top : y);
+}
+
+/* Line feed, scrolling at the bottom of the scroll region. */
+static void index_down(void) {
+	if (scr.y == scr.bot)
+		scroll_up(scr.top, scr.bot, 1);
+	else if (scr.y < scr.rows - 1)
+		scr.y++;
+}
+
+static void index_up(void) {
+	if (scr.y == scr.top)
+		scroll_down(scr.top, scr.bot, 1);
+	else if (scr.y > 0)
+		scr.y--;
+}
+
+static void insert_cells(int n) {
+	struct cell *l = scr.line[scr.alt][scr.y];
+
+	if (n > scr.cols - scr.x)
+		n = scr.cols - scr.x;
+	memmove(l + scr.x + n, l + scr.x, (scr.cols - scr.x - n) * sizeof(*l));
+	clear_cells(l + scr.x, n);
+}
+
+static void delete_cells(int n) {
+	struct cell *l = scr.line[scr.alt][scr.y];
+
+	if (n > scr.cols - scr.x)
+		n = scr.cols - scr.x;
+	memmove(l + scr.x, l + scr.x + n, (scr.cols - scr.x - n) * sizeof(*l));
+	clear_cells(l + scr.cols - n, n);
+}
+
+static void put_char(uint32_t c) {
+	int w = char_width(c);
+	struct cell *l;
+
+	if (!w)
+		return;
+
+	if (scr.wrapnext) {
+		scr.x = 0;
+		scr.wrapnext = false;
+		index_down();
+	}
+
+	/* A wide character does not fit in the last column. */
+	if (w == 2 && scr.x == scr.cols - 1) {
+		if (!(scr.modes & MODE_WRAP))
+			return;
+		clear_cells(scr.line[scr.alt][scr.y] + scr.x, 1);
+		scr.x = 0;
+		index_down();
+	}
+
+	if (scr.modes & MODE_INSERT)
+		insert_cells(w);
+
+	l = scr.line[scr.alt][scr.y] + scr.x;
+	l[0] = scr.pen;
+	l[0].ch = c;
+	if (c < 0x80 && scr.charsets[scr.shift] == CHARSET_ACS)
+		l[0].flags |= CELL_ACS;
+	if (w == 2 && scr.cols > 1) {
+		l[1] = l[0];
+		l[1].ch = 0;
+	}
+
+	scr.x += w;
+	if (scr.x >= scr.cols) {
+		scr.x = scr.cols - 1;
+		scr.wrapnext = (scr.modes & MODE_WRAP) != 0;
+	}
+}
+
+static void save_cursor(void) {
+	scr.saved.x = scr.x;
+	scr.saved.y = scr.y;
+	scr.saved.pen = scr.pen;
+	scr.saved.origin = scr.modes & MODE_ORIGIN;
+	memcpy(scr.saved.charsets, scr.charsets, sizeof(scr.charsets));
+	scr.saved.shift = scr.shift;
+}
+
+static void restore_cursor(void) {
+	scr.pen = scr.saved.pen;
+	scr.modes = (scr.modes & ~MODE_ORIGIN) | scr.saved.origin;
+	memcpy(scr.charsets, scr.saved.charsets, sizeof(scr.charsets));
+	scr.shift = scr.saved.shift;
+	move_to(scr.saved.x, scr.saved.y);
+}
+
+static void set_alt(int alt) {
+	if (scr.alt == alt)
+		return;
+	scr.alt = alt;
+	if (alt)
+		clear_lines(0, scr.rows - 1);
+}
+
+static void reset(void) {
+	memset(&scr.pen, 0, sizeof(scr.pen));
+	scr.alt = 0;
+	scr.x = scr.y = 0;
+	scr.wrapnext = false;
+	scr.top = 0;
+	scr.bot = scr.rows - 1;
+	scr.modes = MODE_DEFAULT;
+	memset(scr.charsets, 0, sizeof(scr.charsets));
+	scr.shift = 0;
+	save_cursor();
+	scr.alt = 1;
+	clear_lines(0, scr.rows - 1);
+	scr.alt = 0;
+	clear_lines(0, scr.rows - 1);
+}
+
+/* An extended color: 5;n or 2;r;g;b, the latter mapped to the color cube. */
+static int sgr_color(int *i, uint8_t *color) {
+	int *p = scr.params;
+
+	if (*i + 2 < scr.nparams && p[*i + 1] == 5) {
+		*color = p[*i + 2];
+		*i += 2;
+		return 1;
+	}
+	if (*i + 4 < scr.nparams && p[*i + 1] == 2) {
+		int r = p[*i + 2], g = p[*i + 3], b = p[*i + 4];
+
+		*color = 16 + 36 * (r * 5 / 255) + 6 * (g * 5 / 255) + b * 5 / 255;
+		*i += 4;
+		return 1;
+	}
+
+	*i = scr.nparams;
+	return 0;
+}
+
+static void sgr(void) {
+	struct cell *pen = &scr.pen;
+
+	if (!scr.nparams)
+		scr.params[scr.nparams++] = 0;
+
+	for (int i = 0; i < scr.nparams; i++) {
+		int p = scr.params[i];
+
+		if (p == 0) {
+			pen->attr = 0;
+			pen->flags = 0;
+			pen->fg = pen->bg = 0;
+		} else if (p == 1)
+			pen->attr |= ATTR_BOLD;
+		else if (p == 2)
+			pen->attr |= ATTR_DIM;
+		else if (p == 3)
+			pen->attr |= ATTR_ITALIC;
+		else if (p == 4)
+			pen->attr |= ATTR_UNDERLINE;
+		else if (p == 5 || p == 6)
+			pen->attr |= ATTR_BLINK;
+		else if (p == 7)
+			pen->attr |= ATTR_REVERSE;
+		else if (p == 8)
+			pen->attr |= ATTR_HIDDEN;
+		else if (p == 9)
+			pen->attr |= ATTR_STRIKE;
+		else if (p == 21 || p == 22)
+			pen->attr &= ~(ATTR_BOLD | ATTR_DIM);
+		else if (p == 23)
+			pen->attr &= ~ATTR_ITALIC;
+		else if (p == 24)
+			pen->attr &= ~ATTR_UNDERLINE;
+		else if (p == 25)
+			pen->attr &= ~ATTR_BLINK;
+		else if (p == 27)
+			pen->attr &= ~ATTR_REVERSE;
+		else if (p == 28)
+			pen->attr &= ~ATTR_HIDDEN;
+		else if (p == 29)
+			pen->attr &= ~ATTR_STRIKE;
+		else if (p >= 30 && p <= 37) {
+			pen->fg = p - 30;
+			pen->flags |= CELL_FG;
+		} else if (p == 38) {
+			if (sgr_color(&i, &pen->fg))
+				pen->flags |= CELL_FG;
+		} else if (p == 39)
+			pen->flags &= ~CELL_FG;
+		else if (p >= 40 && p <= 47) {
+			pen->bg = p - 40;
+			pen->flags |= CELL_BG;
+		} else if (p == 48) {
+			if (sgr_color(&i, &pen->bg))
+				pen->flags |= CELL_BG;
+		} else if (p == 49)
+			pen->flags &= ~CELL_BG;
+		else if (p >= 90 && p <= 97) {
+			pen->fg = p - 90 + 8;
+			pen->flags |= CELL_FG;
+		} else if (p >= 100 && p <= 107) {
+			pen->bg = p - 100 + 8;
+			pen->flags |= CELL_BG;
+		}
+	}
+}
+
+static void set_modes(bool on) {
+	for (int i = 0; i < scr.nparams; i++) {
+		int p = scr.params[i];
+
+		if (!scr.priv) {
+			if (p == 4)
+				scr.modes = on ? scr.modes | MODE_INSERT : scr.modes & ~MODE_INSERT;
+			continue;
+		}
+
+		if (p == 47 || p == 1047) {
+			set_alt(on);
+			continue;
+		} else if (p == 1048) {
+			if (on)
+				save_cursor();
+			else
+				restore_cursor();
+			continue;
+		} else if (p == 1049) {
+			if (on) {
+				save_cursor();
+				set_alt(1);
+			} else {
+				set_alt(0);
+				restore_cursor();
+			}
+			continue;
+		}
+
+		for (auto &it : private_modes) {
+			if (it.num != p)
+				continue;
+			scr.modes = on ? scr.modes | it.mode : scr.modes & ~it.mode;
+			if (it.mode == MODE_ORIGIN)
+				move_to_origin(0, 0);
+			break;
+		}
+	}
+}
+
+static void csi_dispatch(unsigned char c) {
+	int *p = scr.params;
+	int n = scr.nparams && p[0] ? p[0] : 1;
+
+	/* Sequences we don't model. */
+	if (scr.inter && !(scr.inter == '!' && c == 'p'))
+		return;
+	if (scr.priv && scr.priv != '?')
+		return;
+
+	switch (c) {
+	case '@':
+		insert_cells(n);
+		break;
+	case 'A':
+		move_to(scr.x, scr.y - n < scr.top && scr.y >= scr.top ? scr.top : scr.y - n);
+		break;
+	case 'B':
+	case 'e':
+		move_to(scr.x, scr.y + n > scr.bot && scr.y <= scr.bot ? scr.bot : scr.y + n);
+		break;
+	case 'C':
+	case 'a':
+		move_to(scr.x + n, scr.y);
+		break;
+	case 'D':
+		move_to(scr.x - n, scr.y);
+		break;
+	case 'E':
+		move_to(0, scr.y + n > scr.bot && scr.y <= scr.bot ? scr.bot : scr.y + n);
+		break;
+	case 'F':
+		move_to(0, scr.y - n < scr.top && scr.y >= scr.top ? scr.top : scr.y - n);
+		break;
+	case 'G':
+	case '`':
+		move_to(n - 1, scr.y);
+		break;
+	case 'H':
+	case 'f':
+		move_to_origin(scr.nparams > 1 && p[1] ? p[1] - 1 : 0, n - 1);
+		break;
+	case 'I':
+		while (n--)
+			move_to((scr.x + 8) & ~7, scr.y);
+		break;
+	case 'J': {
+		int mode = scr.nparams ? p[0] : 0;
+		struct cell *l = scr.line[scr.alt][scr.y];
+
+		if (mode == 0) {
+			clear_cells(l + scr.x, scr.cols - scr.x);
+			clear_lines(scr.y + 1, scr.rows - 1);
+		} else if (mode == 1) {
+			clear_lines(0, scr.y - 1);
+			clear_cells(l, scr.x + 1);
+		} else if (mode == 2 || mode == 3) {
+			clear_lines(0, scr.rows - 1);
+		}
+		break;
+	}
+	case 'K': {
+		int mode = scr.nparams ? p[0] : 0;
+		struct cell *l = scr.line[scr.alt][scr.y];
+
+		if (mode == 0)
+			clear_cells(l + scr.x, scr.cols - scr.x);
+		else if (mode == 1)
+			clear_cells(l, scr.x + 1);
+		else if (mode == 2)
+			clear_cells(l, scr.cols);
+		break;
+	}
+	case 'L':
+		if (scr.y >= scr.top && scr.y <= scr.bot) {
+			scroll_down(scr.y, scr.bot, n);
+			scr.x = 0;
+		}
+		break;
+	case 'M':
+		if (scr.y >= scr.top && scr.y <= scr.bot) {
+			scroll_up(scr.y, scr.bot, n);
+			scr.x = 0;
+		}
+		break;
+	case 'P':
+		delete_cells(n);
+		break;
+	case 'S':
+		scroll_up(scr.top, scr.bot, n);
+		break;
+	case 'T':
+		scroll_down(scr.top, scr.bot, n);
+		break;
+	case 'X':
+		if (n > scr.cols - scr.x)
+			n = scr.cols - scr.x;
+		clear_cells(scr.line[scr.alt][scr.y] + scr.x, n);
+		break;
+	case 'Z':
+		while (n--)
+			move_to(scr.x ? (scr.x - 1) & ~7 : 0, scr.y);
+		break;
+	case 'b':
+		if (scr.x > 0) {
+			uint32_t ch = scr.line[scr.alt][scr.y][scr.x - 1].ch;
+
+			while (ch && n--)
+				put_char(ch);
+		}
+		break;
+	case 'd':
+		move_to_origin(scr.x, n - 1);
+		break;
+	case 'h':
+		set_modes(true);
+		break;
+	case 'l':
+		set_modes(false);
+		break;
+	case 'm':
+		if (!scr.priv)
+			sgr();
+		break;
+	case 'p':
+		/* DECSTR, a soft reset. */
+		memset(&scr.pen, 0, sizeof(scr.pen));
+		scr.modes = MODE_DEFAULT;
+		scr.top = 0;
+		scr.bot = scr.rows - 1;
+		memset(scr.charsets, 0, sizeof(scr.charsets));
+		scr.shift = 0;
+		break;
+	case 'r': {
+		int top = scr.nparams && p[0] ? p[0] - 1 : 0;
+		int bot = scr.nparams > 1 && p[1] ? p[1] - 1 : scr.rows - 1;
+
+		if (bot >= scr.rows)
+			bot = scr.rows - 1;
+		if (top < bot) {
+			scr.top = top;
+			scr.bot = bot;
+			move_to_origin(0, 0);
+		}
+		break;
+	}
+	case 's':
+		save_cursor();
+		break;
+	case 'u':
+		restore_cursor();
+		break;
+	}
+}
+
+static void esc_dispatch(unsigned char c) {
+	if (scr.inter == '(' || scr.inter == ')') {
+		scr.charsets[scr.inter == ')'] = c == '0' ? CHARSET_ACS : CHARSET_ASCII;
+		return;
+	}
+	if (scr.inter)
+		return;
+
+	switch (c) {
+	case '7':
+		save_cursor();
+		break;
+	case '8':
+		restore_cursor();
+		break;
+	case 'D':
+		index_down();
+		break;
+	case 'E':
+		scr.x = 0;
+		index_down();
+		break;
+	case 'M':
+		index_up();
+		break;
+	case 'c':
+		reset();
+		break;
+	case '=':
+		scr.modes |= MODE_APPKEYPAD;
+		break;
+	case '>':
+		scr.modes &= ~MODE_APPKEYPAD;
+		break;
+	}
+}
+
+static void control(unsigned char c) {
+	switch (c) {
+	case '\b':
+		if (scr.x > 0)
+			move_to(scr.x - 1, scr.y);
+		break;
+	case '\t':
+		move_to((scr.x + 8) & ~7, scr.y);
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		scr.wrapnext = false;
+		index_down();
+		break;
+	case '\r':
+		scr.x = 0;
+		scr.wrapnext = false;
+		break;
+	case 016:
+		scr.shift = 1;
+		break;
+	case 017:
+		scr.shift = 0;
+		break;
+	}
+}
+
+/* Feed one byte of output to the parser. */
+static void feed(unsigned char c) {
+	/* These interrupt any sequence. */
+	if (c == 030 || c == 032) {
+		scr.state = STATE_GROUND;
+		return;
+	}
+	if (c == 033 && scr.state != STATE_STRING && scr.state != STATE_STRING_ESC) {
+		scr.state = STATE_ESC;
+		scr.inter = 0;
+		scr.utf8_need = 0;
+		return;
+	}
+
+	switch (scr.state) {
+	case STATE_GROUND:
+		if (scr.utf8_need) {
+			if ((c & 0xc0) == 0x80) {
+				scr.utf8_cp = (scr.utf8_cp << 6) | (c & 0x3f);
+				if (!--scr.utf8_need)
+					put_char(scr.utf8_cp);
+				return;
+			}
+			/* Broken sequence, start over with this byte. */
+			scr.utf8_need = 0;
+			put_char(0xfffd);
+		}
+
+		if (c < 0x20 || c == 0x7f)
+			control(c);
+		else if (c < 0x80)
+			put_char(c);
+		else if ((c & 0xe0) == 0xc0) {
+			scr.utf8_cp = c & 0x1f;
+			scr.utf8_need = 1;
+		} else if ((c & 0xf0) == 0xe0) {
+			scr.utf8_cp = c & 0x0f;
+			scr.utf8_need = 2;
+		} else if ((c & 0xf8) == 0xf0) {
+			scr.utf8_cp = c & 0x07;
+			scr.utf8_need = 3;
+		} else
+			put_char(0xfffd);
+		break;
+
+	case STATE_ESC:
+		if (c == '[') {
+			scr.state = STATE_CSI;
+			scr.priv = scr.inter = 0;
+			scr.nparams = 0;
+			scr.params[0] = 0;
+		} else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+			scr.state = STATE_STRING;
+		} else if (c >= 0x20 && c < 0x30) {
+			scr.inter = c;
+			scr.state = STATE_ESC_INTER;
+		} else if (c < 0x20) {
+			control(c);
+		} else {
+			esc_dispatch(c);
+			scr.state = STATE_GROUND;
+		}
+		break;
+
+	case STATE_ESC_INTER:
+		if (c < 0x20) {
+			control(c);
+		} else if (c >= 0x30) {
+			esc_dispatch(c);
+			scr.state = STATE_GROUND;
+		}
+		break;
+
+	case STATE_CSI:
+		if (c >= '0' && c <= '9') {
+			if (!scr.nparams)
+				scr.nparams = 1;
+			int *v = &scr.params[scr.nparams - 1];
+
+			if (*v < 100000)
+				*v = *v * 10 + (c - '0');
+		} else if (c == ';' || c == ':') {
+			if (!scr.nparams)
+				scr.nparams = 1;
+			if (scr.nparams < CSI_MAX_PARAMS)
+				scr.params[scr.nparams++] = 0;
+		} else if (c >= '<' && c <= '?') {
+			scr.priv = c;
+		} else if (c >= 0x20 && c < 0x30) {
+			scr.inter = c;
+		} else if (c >= 0x40 && c <= 0x7e) {
+			csi_dispatch(c);
+			scr.state = STATE_GROUND;
+		} else if (c < 0x20) {
+			control(c);
+		}
+		break;
+
+	case STATE_STRING:
+		if (c == 007)
+			scr.state = STATE_GROUND;
+		else if (c == 033)
+			scr.state = STATE_STRING_ESC;
+		break;
+
+	case STATE_STRING_ESC:
+		scr.state = c == '\\' ? STATE_GROUND : STATE_STRING;
+		break;
+	}
+}
+
+void screen_feed(const unsigned char *buf, size_t len) {
+	size_t i = 0;
+
+	while (i < len) {
+		/*
+		** Plain text is by far the most common, so runs of it that
+		** need no wrapping go straight into the cells.
+		*/
+		if (scr.state == STATE_GROUND && !scr.utf8_need &&
+		    !scr.wrapnext && !(scr.modes & MODE_INSERT) &&
+		    scr.charsets[scr.shift] == CHARSET_ASCII) {
+			struct cell *l = scr.line[scr.alt][scr.y];
+			struct cell pen = scr.pen;
+			int x = scr.x, end = scr.cols - 1;
+
+			while (i < len && x < end &&
+			       buf[i] >= 0x20 && buf[i] < 0x7f) {
+				pen.ch = buf[i++];
+				l[x++] = pen;
+			}
+			scr.x = x;
+			if (i == len)
+				break;
+		}
+
+		feed(buf[i++]);
+	}
+}
+
+/* Allocate the screens, keeping what fits of the old ones. */
+static void alloc_screens(int rows, int cols) {
+	struct cell *cells[2];
+	struct cell **line[2];
+
+	for (int s = 0; s < 2; s++) {
+		cells[s] = (struct cell *)malloc(sizeof(struct cell) * rows * cols);
+		line[s] = (struct cell **)malloc(sizeof(struct cell *) * rows);
+		if (!cells[s] || !line[s]) {
+			THROW_ERROR("out of memory");
+		}
+		for (int y = 0; y < rows; y++)
+			line[s][y] = cells[s] + y * cols;
+	}
+
+	/* Shrinking keeps the lines around the cursor. */
+	int shift = scr.y >= rows ? scr.y - rows + 1 : 0;
+
+	for (int s = 0; s < 2; s++) {
+		int alt = scr.alt;
+
+		scr.alt = s;
+		for (int y = 0; y < rows; y++) {
+			int from = y + shift;
+			int n = 0;
+
+			if (scr.line[s] && from < scr.rows) {
+				n = cols < scr.cols ? cols : scr.cols;
+				memcpy(line[s][y], scr.line[s][from], n * sizeof(struct cell));
+			}
+			clear_cells(line[s][y] + n, cols - n);
+		}
+		scr.alt = alt;
+
+		free(scr.cells[s]);
+		free(scr.line[s]);
+		scr.cells[s] = cells[s];
+		scr.line[s] = line[s];
+	}
+
+	free(scr.spare);
+	scr.spare = (struct cell **)malloc(sizeof(struct cell *) * rows);
+	if (!scr.spare) {
+		THROW_ERROR("out of memory");
+	}
+
+	scr.y -= shift;
+	scr.saved.y -= shift;
+	scr.rows = rows;
+	scr.cols = cols;
+}
+
+void screen_init(int rows, int cols) {
+	memset(&scr, 0, sizeof(scr));
+	alloc_screens(rows > 0 ? rows : 24, cols > 0 ? cols : 80);
+	reset();
+	screen_active = true;
+}
+
+void screen_resize(int rows, int cols) {
+	if (!screen_active || rows <= 0 || cols <= 0)
+		return;
+	if (rows == scr.rows && cols == scr.cols)
+		return;
+
+	alloc_screens(rows, cols);
+
+	scr.top = 0;
+	scr.bot = rows - 1;
+	move_to(scr.x, scr.y);
+	scr.saved.x = scr.saved.x >= cols ? cols - 1 : scr.saved.x;
+	scr.saved.y = scr.saved.y < 0 ? 0 : scr.saved.y >= rows ? rows - 1 : scr.saved.y;
+}
+
+/* A growable output buffer for the snapshot. */
+struct obuf {
+	char *buf;
+	size_t len, size;
+};
+
+static void put(struct obuf *o, const char *s, size_t len) {
+	if (o->len + len > o->size) {
+		size_t size = o->size ? o->size : 4096;
+
+		while (size < o->len + len)
+			size *= 2;
+
+		char *buf = (char *)realloc(o->buf, size);
+
+		if (!buf) {
+			THROW_ERROR("out of memory");
+		}
+		o->buf = buf;
+		o->size = size;
+	}
+
+	memcpy(o->buf + o->len, s, len);
+	o->len += len;
+}
+
+static void __attribute__ ((__format__ (__printf__, 2, 3))) putf(struct obuf *o, const char *fmt, ...) {
+	char buf[64];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	put(o, buf, len);
+}
+
+static void put_utf8(struct obuf *o, uint32_t c) {
+	char buf[4];
+	size_t len;
+
+	if (c < 0x80) {
+		buf[0] = c;
+		len = 1;
+	} else if (c < 0x800) {
+		buf[0] = 0xc0 | (c >> 6);
+		buf[1] = 0x80 | (c & 0x3f);
+		len = 2;
+	} else if (c < 0x10000) {
+		buf[0] = 0xe0 | (c >> 12);
+		buf[1] = 0x80 | ((c >> 6) & 0x3f);
+		buf[2] = 0x80 | (c & 0x3f);
+		len = 3;
+	} else {
+		buf[0] = 0xf0 | (c >> 18);
+		buf[1] = 0x80 | ((c >> 12) & 0x3f);
+		buf[2] = 0x80 | ((c >> 6) & 0x3f);
+		buf[3] = 0x80 | (c & 0x3f);
+		len = 4;
+	}
+
+	put(o, buf, len);
+}
+
+static void put_color(struct obuf *o, int base, uint8_t color) {
+	if (color < 8)
+		putf(o, ";%d", base + color);
+	else if (color < 16)
+		putf(o, ";%d", base + 60 + color - 8);
+	else
+		putf(o, ";%d;5;%d", base + 8, color);
+}
+
+/* Switch to the attributes of a cell. */
+static void put_sgr(struct obuf *o, const struct cell *c) {
+	static const char codes[] = { 1, 2, 3, 4, 5, 7, 8, 9 };
+
+	put(o, "\33[0", 3);
+	for (int i = 0; i < 8; i++)
+		if (c->attr & (1 << i))
+			putf(o, ";%d", codes[i]);
+	if (c->flags & CELL_FG)
+		put_color(o, 30, c->fg);
+	if (c->flags & CELL_BG)
+		put_color(o, 40, c->bg);
+	put(o, "m", 1);
+}
+
+static bool same_look(const struct cell *a, const struct cell *b) {
+	return a->attr == b->attr &&
+	       (a->flags & (CELL_FG | CELL_BG)) == (b->flags & (CELL_FG | CELL_BG)) &&
+	       (!(a->flags & CELL_FG) || a->fg == b->fg) &&
+	       (!(a->flags & CELL_BG) || a->bg == b->bg);
+}
+
+/* What the terminal has been told so far while painting. */
+struct pen_state {
+	struct cell look;
+	bool acs;
+};
+
+/* Paint the cells from..to-1 of a row, the cursor being at from. */
+static void put_cells(struct obuf *o, struct pen_state *ps, const struct cell *l,
+		      int from, int to) {
+	bool wide = false;
+
+	for (int x = from; x < to; x++) {
+		const struct cell *c = &l[x];
+		bool c_acs = (c->flags & CELL_ACS) != 0;
+
+		/* The right half of a wide character. */
+		if (!c->ch && wide) {
+			wide = false;
+			continue;
+		}
+
+		if (!same_look(c, &ps->look)) {
+			put_sgr(o, c);
+			ps->look = *c;
+		}
+		if (c_acs != ps->acs) {
+			put(o, c_acs ? "\33(0" : "\33(B", 3);
+			ps->acs = c_acs;
+		}
+
+		put_utf8(o, c->ch ? c->ch : ' ');
+		wide = c->ch && char_width(c->ch) == 2;
+	}
+}
+
+/* Paint one of the screens. */
+static void put_screen(struct obuf *o, int s) {
+	struct pen_state ps;
+
+	memset(&ps, 0, sizeof(ps));
+	put(o, "\33[0m\33[H\33[2J", 11);
+
+	for (int y = 0; y < scr.rows; y++) {
+		const struct cell *l = scr.line[s][y];
+		const struct cell *last = &l[scr.cols - 1];
+		int end = scr.cols;
+		bool fill = false;
+
+		/* Leave out the blanks at the end. The clear took care of them
+		** if they have the default background, otherwise an erase to
+		** the end of the line does. */
+		if (last->ch == ' ' && !last->attr) {
+			while (end > 0 && l[end - 1].ch == ' ' && !l[end - 1].attr &&
+			       same_look(&l[end - 1], last))
+				end--;
+			fill = (last->flags & CELL_BG) != 0;
+		}
+		if (!end && !fill)
+			continue;
+
+		putf(o, "\33[%dH", y + 1);
+		put_cells(o, &ps, l, 0, end);
+
+		if (fill) {
+			if (!same_look(last, &ps.look)) {
+				put_sgr(o, last);
+				ps.look = *last;
+			}
+			put(o, "\33[K", 3);
+		}
+	}
+
+	if (ps.acs)
+		put(o, "\33(B", 3);
+}
+
+/*
+** Restore the cursor, the scroll region and the modes. Only the modes that
+** differ from old are sent.
+*/
+static void put_state(struct obuf *o, uint32_t old) {
+	/* Where DECRC takes the cursor. */
+	putf(o, "\33[%d;%dH", scr.saved.y + 1, scr.saved.x + 1);
+	put_sgr(o, &scr.saved.pen);
+	put(o, "\0337", 2);
+
+	if (scr.top != 0 || scr.bot != scr.rows - 1)
+		putf(o, "\33[%d;%dr", scr.top + 1, scr.bot + 1);
+	else
+		put(o, "\33[r", 3);
+
+	for (auto &it : private_modes) {
+		uint32_t on = scr.modes & it.mode;
+
+		if (on != (old & it.mode))
+			putf(o, "\33[?%d%c", it.num, on ? 'h' : 'l');
+	}
+	if (scr.modes & MODE_INSERT)
+		put(o, "\33[4h", 4);
+	put(o, scr.modes & MODE_APPKEYPAD ? "\33=" : "\33>", 2);
+
+	if (scr.wrapnext) {
+		/* Write the last character again, which leaves the cursor
+		** waiting to wrap, like the program did. */
+		const struct cell *l = scr.line[scr.alt][scr.y];
+		int x = scr.cols - 1;
+
+		if (!l[x].ch && x > 0)
+			x--;
+		putf(o, "\33[%d;%dH",
+		     scr.y + 1 - ((scr.modes & MODE_ORIGIN) ? scr.top : 0), x + 1);
+		put_sgr(o, &l[x]);
+		if (l[x].flags & CELL_ACS)
+			put(o, "\33(0\17", 4);
+		put_utf8(o, l[x].ch ? l[x].ch : ' ');
+	} else {
+		putf(o, "\33[%d;%dH",
+		     scr.y + 1 - ((scr.modes & MODE_ORIGIN) ? scr.top : 0), scr.x + 1);
+	}
+
+	putf(o, "\33(%c\33)%c%c",
+	     scr.charsets[0] == CHARSET_ACS ? '0' : 'B',
+	     scr.charsets[1] == CHARSET_ACS ? '0' : 'B',
+	     scr.shift ? 016 : 017);
+	put_sgr(o, &scr.pen);
+}
+
+static void put_snapshot(struct obuf *o) {
+	/* Start from a known state. */
+	put(o, "\33[?1049l\33[r\33[?6l\33[4l\33[?7h", 25);
+
+	put_screen(o, 0);
+	if (scr.alt) {
+		put(o, "\33[?1049h", 8);
+		put_screen(o, 1);
+	}
+
+	/* The modes start out with their defaults after the reset. */
+	put_state(o, MODE_DEFAULT);
+}
+
+/*
+** Render the screen as a stream of escape sequences that paints it on a
+** terminal, along with the cursor and the modes. The main screen goes first,
+** so the terminal has it to go back to when the program leaves the alternate
+** one. The caller frees the returned buffer.
+*/
+char *screen_snapshot(size_t *len) {
+	struct obuf o;
+
+	memset(&o, 0, sizeof(o));
+	put_snapshot(&o);
+
+	*len = o.len;
+	return o.buf;
+}
+
+/* What a client was last sent, to work out what changed since. */
+struct screen_view {
+	int rows, cols, alt;
+	uint32_t modes;
+	struct cell *cells;
+};
+
+/* Remember the showing screen as what the client has now. */
+static void save_view(struct screen_view *v) {
+	for (int y = 0; y < scr.rows; y++)
+		memcpy(v->cells + y * scr.cols, scr.line[scr.alt][y],
+		       scr.cols * sizeof(struct cell));
+	v->modes = scr.modes;
+}
+
+/* Paint the cells that changed since the view was saved. */
+static void put_diff(struct obuf *o, struct screen_view *v) {
+	struct pen_state ps;
+
+	/* Cursor positions are absolute while painting, put_state() sets the
+	** modes back. */
+	memset(&ps, 0, sizeof(ps));
+	put(o, "\33[0m\33(B\17\33[?6l\33[4l", 18);
+
+	for (int y = 0; y < scr.rows; y++) {
+		const struct cell *l = scr.line[scr.alt][y];
+		const struct cell *old = v->cells + y * scr.cols;
+		int x = 0;
+
+		while (x < scr.cols) {
+			if (!memcmp(&l[x], &old[x], sizeof(struct cell))) {
+				x++;
+				continue;
+			}
+
+			/* Paint a run of changes, including short stretches
+			** of unchanged cells, which is cheaper than moving. */
+			int from = x > 0 && !l[x].ch ? x - 1 : x;
+			int to = x + 1;
+
+			for (int same = 0; to < scr.cols && same < 4; to++) {
+				if (!memcmp(&l[to], &old[to], sizeof(struct cell)))
+					same++;
+				else
+					same = 0;
+			}
+			while (to > x + 1 && !memcmp(&l[to - 1], &old[to - 1], sizeof(struct cell)))
+				to--;
+			/* Don't cut a wide character in half. */
+			if (to < scr.cols && !l[to].ch)
+				to++;
+
+			putf(o, "\33[%d;%dH", y + 1, from + 1);
+			put_cells(o, &ps, l, from, to);
+			x = to;
+		}
+	}
+
+	if (ps.acs)
+		put(o, "\33(B", 3);
+
+	put_state(o, v->modes & ~(MODE_ORIGIN | MODE_INSERT));
+}
+
+/*
+** Bring a client from what it was last sent up to the current screen. The
+** first time, or when the size or the showing screen changed since, it gets
+** a whole snapshot. After that only the cells that changed, and the cursor
+** and the modes, are sent. The caller frees the returned buffer.
+*/
+char *screen_sync(struct screen_view **view, size_t *len) {
+	struct screen_view *v = *view;
+	struct obuf o;
+
+	memset(&o, 0, sizeof(o));
+
+	if (v && v->rows == scr.rows && v->cols == scr.cols && v->alt == scr.alt) {
+		put_diff(&o, v);
+	} else {
+		if (!v || v->rows * v->cols != scr.rows * scr.cols) {
+			screen_view_free(v);
+			v = (struct screen_view *)calloc(1, sizeof(*v));
+			if (!v || !(v->cells = (struct cell *)malloc(sizeof(struct cell) * scr.rows * scr.cols))) {
+				THROW_ERROR("out of memory");
+			}
+			*view = v;
+		}
+		v->rows = scr.rows;
+		v->cols = scr.cols;
+		v->alt = scr.alt;
+		put_snapshot(&o);
+	}
+
+	save_view(v);
+
+	*len = o.len;
+	return o.buf;
+}
+
+void screen_view_free(struct screen_view *view) {
+	if (!view)
+		return;
+
+	free(view->cells);
+	free(view);
+}
@@ -89,6 +89,33 @@ void ensure_mkfifo(const char *s) {
 	}
 }
 
+void ensure_symlink(const char *target, const char *s) {
+	// Replace whatever a previous session left behind
+	if (symlink(target, s)) {
+		if (errno != EEXIST || unlink(s) || symlink(target, s)) {
+			THROW_ERROR("symlink");
+		}
+	}
+}
+
+/* Throws away everything that can be read from a non-blocking descriptor. */
+void drain_fd(int fd) {
+	unsigned char buf[BUFSIZE];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/* Raises the limit of open descriptors as far as we are allowed to. */
+void raise_fd_limit(void) {
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
 /* Sets a file descriptor to non-blocking mode. */
 int setnonblocking(int fd) {
 	int flags;
@@ -120,3 +147,144 @@ char * __attribute__ ((__format__ (__printf__, 1, 2))) _str_fmt(const char *fmt,
 
 	return format_buf;
 }
+
+/* Parses a size such as "4096", "64k" or "1m". Returns -1 if invalid. */
+long parse_size(const char *s) {
+	char *end;
+	long ret, unit = 1;
+
+	errno = 0;
+	ret = strtol(s, &end, 10);
+	if (errno || end == s || ret < 0)
+		return -1;
+
+	if (*end == 'k' || *end == 'K') {
+		unit = 1024;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		unit = 1024 * 1024;
+		end++;
+	}
+
+	if (*end || ret > LONG_MAX / unit)
+		return -1;
+
+	ret *= unit;
+
+	return ret;
+}
+
+/* Returns a monotonic timestamp in microseconds. */
+uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** Byte ring buffers. The storage is allocated lazily and grown on demand up
+** to the limit given by the caller, so an idle ring costs nothing.
+*/
+static int ring_grow(struct ring *r, size_t need, size_t limit) {
+	size_t size = r->size ? r->size : BUFSIZE;
+	unsigned char *buf;
+
+	while (size < need)
+		size *= 2;
+	if (size > limit)
+		size = limit;
+
+	buf = (unsigned char *)malloc(size);
+	if (!buf)
+		return -1;
+
+	/* Unwrap the old contents to the beginning of the new storage. */
+	if (r->len) {
+		size_t first = r->size - r->head;
+
+		if (first > r->len)
+			first = r->len;
+		memcpy(buf, r->buf + r->head, first);
+		memcpy(buf + first, r->buf, r->len - first);
+	}
+
+	free(r->buf);
+	r->buf = buf;
+	r->size = size;
+	r->head = 0;
+	return 0;
+}
+
+int ring_push(struct ring *r, const void *data, size_t count, size_t limit) {
+	size_t tail, first;
+
+	if (!count)
+		return 0;
+
+	if (r->len + count > limit)
+		return -1;
+
+	if (r->len + count > r->size && ring_grow(r, r->len + count, limit))
+		return -1;
+
+	tail = (r->head + r->len) % r->size;
+	first = r->size - tail;
+	if (first > count)
+		first = count;
+
+	memcpy(r->buf + tail, data, first);
+	memcpy(r->buf, (const unsigned char *)data + first, count - first);
+	r->len += count;
+	return 0;
+}
+
+int ring_peek(const struct ring *r, struct iovec iov[2]) {
+	size_t first;
+
+	if (!r->len)
+		return 0;
+
+	first = r->size - r->head;
+	if (first >= r->len) {
+		iov[0].iov_base = r->buf + r->head;
+		iov[0].iov_len = r->len;
+		return 1;
+	}
+
+	iov[0].iov_base = r->buf + r->head;
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = r->len - first;
+	return 2;
+}
+
+void ring_consume(struct ring *r, size_t count) {
+	if (count >= r->len) {
+		ring_clear(r);
+		return;
+	}
+
+	r->head = (r->head + count) % r->size;
+	r->len -= count;
+}
+
+void ring_clear(struct ring *r) {
+	r->head = 0;
+	r->len = 0;
+
+	/* Give back anything larger than the initial allocation. */
+	if (r->size > BUFSIZE) {
+		free(r->buf);
+		r->buf = nullptr;
+		r->size = 0;
+	}
+}
+
+void ring_free(struct ring *r) {
+	free(r->buf);
+	r->buf = nullptr;
+	r->size = 0;
+	r->head = 0;
+	r->len = 0;
+}